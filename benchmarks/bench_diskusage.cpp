@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusage_p.h"
+#include "diskusageindex_p.h"
+#include "diskusagewalker_p.h"
+
+#include "bench_diskusage.h"
+
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Same sequence on every run, so that the trees are comparable between runs
+class Random
+{
+public:
+    Random() : m_state(0x5eed) {}
+
+    quint32 next(quint32 bound)
+    {
+        m_state = m_state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return quint32(m_state >> 33) % bound;
+    }
+
+private:
+    quint64 m_state;
+};
+
+bool writeFile(const QString &path, int size)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot create" << path << file.errorString();
+        return false;
+    }
+    return file.write(QByteArray(size, 'x')) == size;
+}
+
+// A single directory with many entries
+bool createWide(const QString &path, Random *random)
+{
+    for (int i = 0; i < 20000; ++i) {
+        if (!writeFile(QString("%1/file%2").arg(path).arg(i), random->next(4096))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Long chains of directories with a few files on each level
+bool createDeep(const QString &path, Random *random)
+{
+    for (int chain = 0; chain < 64; ++chain) {
+        QString directory = QString("%1/chain%2").arg(path).arg(chain);
+        for (int depth = 0; depth < 64; ++depth) {
+            directory += QString("/level%1").arg(depth);
+            if (!QDir().mkpath(directory)) {
+                return false;
+            }
+            for (int i = 0; i < 4; ++i) {
+                if (!writeFile(QString("%1/file%2").arg(directory).arg(i), random->next(2048))) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Many directories of tiny files, like caches and configuration
+bool createSmall(const QString &path, Random *random)
+{
+    for (int outer = 0; outer < 20; ++outer) {
+        for (int inner = 0; inner < 25; ++inner) {
+            const QString directory = QString("%1/dir%2/dir%3").arg(path).arg(outer).arg(inner);
+            if (!QDir().mkpath(directory)) {
+                return false;
+            }
+            for (int i = 0; i < 40; ++i) {
+                if (!writeFile(QString("%1/file%2").arg(directory).arg(i), random->next(512))) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Every file has two more links in other directories
+bool createHardlinks(const QString &path, Random *random)
+{
+    QDir dir(path);
+    if (!dir.mkpath("a") || !dir.mkpath("b") || !dir.mkpath("c")) {
+        return false;
+    }
+    for (int i = 0; i < 2000; ++i) {
+        const QByteArray name = QString("/file%1").arg(i).toUtf8();
+        const QByteArray a = QFile::encodeName(path) + "/a" + name;
+        if (!writeFile(QFile::decodeName(a), 4096 + random->next(4096))
+                || ::link(a.constData(), (QFile::encodeName(path) + "/b" + name).constData()) != 0
+                || ::link(a.constData(), (QFile::encodeName(path) + "/c" + name).constData()) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Large apparent sizes with a single block of data each
+bool createSparse(const QString &path, Random *random)
+{
+    for (int i = 0; i < 100; ++i) {
+        const QByteArray file = QFile::encodeName(QString("%1/sparse%2").arg(path).arg(i));
+        const int fd = ::open(file.constData(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        const QByteArray block(4096, 'x');
+        const off_t offset = off_t(random->next(256)) * 1024 * 1024;
+        const bool ok = ::pwrite(fd, block.constData(), block.size(), offset) == block.size()
+                && ::ftruncate(fd, off_t(256) * 1024 * 1024) == 0;
+        ::close(fd);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+qint64 peakResidentKb()
+{
+    QFile status("/proc/self/status");
+    if (status.open(QIODevice::ReadOnly)) {
+        foreach (const QByteArray &line, status.readAll().split('\n')) {
+            if (line.startsWith("VmHWM:")) {
+                return line.mid(6).trimmed().split(' ').value(0).toLongLong();
+            }
+        }
+    }
+    return -1;
+}
+
+}
+
+void Bench_DiskUsage::initTestCase()
+{
+    // Keeps the index of the end to end benchmark out of the real cache
+    QStandardPaths::setTestModeEnabled(true);
+
+    QVERIFY(m_root.isValid());
+
+    typedef bool (*Generator)(const QString &, Random *);
+    const QList<QPair<QString, Generator> > generators = QList<QPair<QString, Generator> >()
+            << qMakePair(QString("wide"), &createWide)
+            << qMakePair(QString("deep"), &createDeep)
+            << qMakePair(QString("small"), &createSmall)
+            << qMakePair(QString("hardlinks"), &createHardlinks)
+            << qMakePair(QString("sparse"), &createSparse);
+
+    for (int i = 0; i < generators.count(); ++i) {
+        Random random;
+        const QString path = m_root.path() + '/' + generators.at(i).first;
+        QVERIFY(QDir().mkpath(path));
+        QVERIFY2(generators.at(i).second(path, &random), qPrintable(path));
+        m_trees << generators.at(i).first;
+    }
+}
+
+void Bench_DiskUsage::init()
+{
+    // Resets VmHWM, so that it shows the peak of this benchmark only
+    QFile clearRefs("/proc/self/clear_refs");
+    if (clearRefs.open(QIODevice::WriteOnly)) {
+        clearRefs.write("5");
+    }
+}
+
+void Bench_DiskUsage::cleanup()
+{
+    qDebug("%s(%s): peak resident set %lld kB", QTest::currentTestFunction(),
+           QTest::currentDataTag() ? QTest::currentDataTag() : "", peakResidentKb());
+}
+
+void Bench_DiskUsage::addTreeRows()
+{
+    QTest::addColumn<QString>("path");
+
+    foreach (const QString &tree, m_trees) {
+        QTest::newRow(qPrintable(tree)) << m_root.path() + '/' + tree;
+    }
+}
+
+void Bench_DiskUsage::benchmarkWalkCold_data()
+{
+    QTest::addColumn<QString>("path");
+    QTest::addColumn<int>("accounting");
+
+    foreach (const QString &tree, m_trees) {
+        QTest::newRow(qPrintable(tree + "/apparent")) << m_root.path() + '/' + tree
+                                                      << int(DiskUsageWalker::ApparentSize);
+        QTest::newRow(qPrintable(tree + "/allocated")) << m_root.path() + '/' + tree
+                                                       << int(DiskUsageWalker::AllocatedSize);
+    }
+}
+
+// Listing every directory, as on the first calculation after boot
+void Bench_DiskUsage::benchmarkWalkCold()
+{
+    QFETCH(QString, path);
+    QFETCH(int, accounting);
+
+    DiskUsageWalker walker;
+    walker.setAccounting(DiskUsageWalker::Accounting(accounting));
+    QList<quint64> sizes;
+    QBENCHMARK {
+        sizes = walker.walk(QStringList() << path);
+    }
+
+    QCOMPARE(sizes.count(), 1);
+    QVERIFY(sizes.first() > 0);
+    if (accounting == DiskUsageWalker::ApparentSize) {
+        m_sizes.insert(path, sizes.first());
+    }
+}
+
+void Bench_DiskUsage::benchmarkWalkIndexed_data()
+{
+    addTreeRows();
+}
+
+// Repeated calculation of an unchanged tree
+void Bench_DiskUsage::benchmarkWalkIndexed()
+{
+    QFETCH(QString, path);
+
+    DiskUsageIndex index(path + ".index");
+    DiskUsageWalker walker;
+    walker.setIndex(&index);
+
+    index.sync();
+    QList<quint64> sizes = walker.walk(QStringList() << path);
+    QBENCHMARK {
+        index.sync();
+        sizes = walker.walk(QStringList() << path);
+    }
+
+    QCOMPARE(sizes.count(), 1);
+    if (m_sizes.contains(path)) {
+        QCOMPARE(sizes.first(), m_sizes.value(path));
+    }
+}
+
+void Bench_DiskUsage::benchmarkCalculate_data()
+{
+    addTreeRows();
+}
+
+// Path expansion, measuring with the process wide index, saving the index
+// and subtracting nested paths
+void Bench_DiskUsage::benchmarkCalculate()
+{
+    QFETCH(QString, path);
+
+    // Along with a subdirectory, if there is one, to have something to subtract
+    QStringList paths = QStringList() << path;
+    const QStringList subdirectories = QDir(path).entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+    if (!subdirectories.isEmpty()) {
+        paths << path + '/' + subdirectories.first();
+    }
+
+    DiskUsageWorker worker;
+    QVariantMap usage;
+    QBENCHMARK {
+        usage = worker.calculate(paths);
+    }
+
+    foreach (const QString &measured, paths) {
+        QVERIFY(usage.contains(measured));
+    }
+}
+
+void Bench_DiskUsage::benchmarkRpmSizes()
+{
+    if (!QFile::exists("/var/lib/rpm") && !QFile::exists("/usr/lib/sysimage/rpm")) {
+        QSKIP("No RPM database");
+    }
+
+    DiskUsageWorker worker;
+    const QStringList globs = QStringList() << "" << "harbour-*" << "lib*" << "qt5-*";
+    QList<quint64> sizes;
+    QBENCHMARK {
+        sizes = worker.calculateRpmSizes(globs);
+    }
+
+    QCOMPARE(sizes.count(), globs.count());
+}
+
+void Bench_DiskUsage::benchmarkSubtractNestedUsage()
+{
+    QVariantMap usage;
+    QHash<QString, QString> expandedPaths;
+
+    usage["/"] = qulonglong(1) << 40;
+    expandedPaths.insert("/", "/");
+    for (int i = 0; i < 5000; ++i) {
+        const QString path = QString("/home/user/.local/share/harbour-app%1/").arg(i);
+        usage[path] = 2 * 1024 * 1024;
+        usage[path + "cache/"] = 1024 * 1024;
+        expandedPaths.insert(path, path);
+        expandedPaths.insert(path + "cache/", path + "cache/");
+    }
+
+    QBENCHMARK {
+        QVariantMap result(usage);
+        DiskUsageWorker::subtractNestedUsage(&result, expandedPaths);
+    }
+}
+
+
+QTEST_GUILESS_MAIN(Bench_DiskUsage)
@@ -0,0 +1,39 @@
+# Benchmarks of the disk usage calculation on synthetic directory trees.
+# Built against the real implementation only when qmake is run with
+# CONFIG+=benchmarks, then run with "make check" or directly, e.g.
+# "./bench_diskusage -iterations 5". Not installed.
+
+QT += testlib qml dbus
+QT -= gui
+
+TEMPLATE = app
+TARGET = bench_diskusage
+
+CONFIG += link_pkgconfig
+PKGCONFIG += mce rpm
+
+QMAKE_EXTRA_TARGETS = check
+
+check.depends = $$TARGET
+check.commands = ./$$TARGET
+
+INCLUDEPATH += ../src/
+
+SOURCES += bench_diskusage.cpp
+HEADERS += bench_diskusage.h
+
+SOURCES += \
+    ../src/batterystatus.cpp \
+    ../src/diskusage.cpp \
+    ../src/diskusage_impl.cpp \
+    ../src/diskusageindex.cpp \
+    ../src/diskusagescheduler.cpp \
+    ../src/diskusagewalker.cpp
+HEADERS += \
+    ../src/batterystatus.h \
+    ../src/batterystatus_p.h \
+    ../src/diskusage.h \
+    ../src/diskusage_p.h \
+    ../src/diskusageindex_p.h \
+    ../src/diskusagescheduler_p.h \
+    ../src/diskusagewalker_p.h
@@ -1,6 +1,6 @@
 Name:       nemo-qml-plugin-systemsettings
 Summary:    System settings plugin for Nemo Mobile
-Version:    0.5.27
+Version:    0.6.0
 Release:    1
 Group:      System/Libraries
 License:    BSD
@@ -30,6 +30,7 @@ BuildRequires:  pkgconfig(connman-qt5) >= 1.2.23
 BuildRequires:  pkgconfig(ssu-sysinfo) >= 1.1.0
 BuildRequires:  pkgconfig(packagekitqt5)
 BuildRequires:  pkgconfig(glib-2.0)
+BuildRequires:  pkgconfig(rpm)
 
 %description
 %{summary}.
@@ -82,5 +83,8 @@ rm -rf %{buildroot}
 
 %files tests
 %defattr(-,root,root,-)
+%{_libdir}/%{name}-tests/ut_certificatemodel
+%{_libdir}/%{name}-tests/ut_certificatetime
 %{_libdir}/%{name}-tests/ut_diskusage
+%{_libdir}/%{name}-tests/ut_diskusagewalker
 %{_datadir}/%{name}-tests/tests.xml
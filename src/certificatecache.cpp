@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "certificatecache_p.h"
+#include "certificatemodel_p.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QPair>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <limits>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace {
+
+const quint32 CacheMagic = 0x43455243; // "CERC"
+const quint32 CacheVersion = 1;
+
+const int HashLength = 32;
+// Longer key identifiers are not cached, issuers are then found by name only
+const int KeyIdentifierLength = 32;
+const qint64 InvalidTime = std::numeric_limits<qint64>::min();
+
+// The file is the header, count records and a pool of UTF-16 strings
+// referred to by the records. Everything is in host byte order.
+struct Header
+{
+    quint32 magic;
+    quint32 version;
+    qint64 bundleMtime;
+    qint64 bundleSize;
+    char bundleHash[HashLength];
+    quint32 count;
+    quint32 poolLength;
+};
+
+struct String
+{
+    quint32 offset;
+    quint32 length;
+};
+
+const int StringCount = 7;
+
+struct Record
+{
+    String strings[StringCount];
+    qint64 notValidBefore;
+    qint64 notValidAfter;
+    qint32 notValidBeforeOffset;
+    qint32 notValidAfterOffset;
+    char fingerprint[HashLength];
+    quint32 subjectNameHash;
+    quint32 issuerNameHash;
+    quint32 subjectKeyIdentifierLength;
+    quint32 authorityKeyIdentifierLength;
+    char subjectKeyIdentifier[KeyIdentifierLength];
+    char authorityKeyIdentifier[KeyIdentifierLength];
+    // The PEM block of the certificate in the bundle, none if pemLength is 0
+    quint32 pemOffset;
+    quint32 pemLength;
+};
+
+bool readBundle(const QString &path, QByteArray *data)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    *data = file.readAll();
+    return true;
+}
+
+qint64 toTime(const QDateTime &time)
+{
+    return time.isValid() ? time.toMSecsSinceEpoch() : InvalidTime;
+}
+
+QDateTime fromTime(qint64 time, qint32 offset)
+{
+    return time == InvalidTime ? QDateTime() : QDateTime::fromMSecsSinceEpoch(time, Qt::OffsetFromUTC, offset);
+}
+
+void toKeyIdentifier(const QByteArray &identifier, char *data, quint32 *length)
+{
+    if (identifier.size() <= KeyIdentifierLength) {
+        memcpy(data, identifier.constData(), identifier.size());
+        *length = identifier.size();
+    }
+}
+
+QByteArray fromKeyIdentifier(const char *data, quint32 length)
+{
+    return QByteArray(data, qMin<quint32>(length, KeyIdentifierLength));
+}
+
+// The offset and length of the PEM blocks in the bundle, by the SHA-256 of
+// what they decode to, which is the fingerprint for certificates
+QHash<QByteArray, QPair<quint32, quint32> > pemBlocks(const QByteArray &bundleData)
+{
+    static const QByteArray begin("-----BEGIN ");
+    static const QByteArray end("-----END ");
+
+    QHash<QByteArray, QPair<quint32, quint32> > blocks;
+    int position = 0;
+    while ((position = bundleData.indexOf(begin, position)) >= 0) {
+        const int bodyStart = bundleData.indexOf('\n', position);
+        const int bodyEnd = bundleData.indexOf(end, position);
+        if (bodyStart < 0 || bodyEnd < bodyStart) {
+            break;
+        }
+        int blockEnd = bundleData.indexOf('\n', bodyEnd);
+        blockEnd = blockEnd < 0 ? bundleData.size() : blockEnd + 1;
+
+        // Invalid characters, i.e. the line breaks, are skipped
+        const QByteArray der(QByteArray::fromBase64(bundleData.mid(bodyStart, bodyEnd - bodyStart)));
+        blocks.insert(QCryptographicHash::hash(der, QCryptographicHash::Sha256),
+                      qMakePair(quint32(position), quint32(blockEnd - position)));
+        position = blockEnd;
+    }
+    return blocks;
+}
+
+}
+
+CertificateCache::CertificateCache(const QString &bundlePath)
+    : m_bundlePath(bundlePath)
+    , m_filePath(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                 + QStringLiteral("/systemsettings/certificates/")
+                 + QString::fromLatin1(QCryptographicHash::hash(QFile::encodeName(bundlePath), QCryptographicHash::Sha1).toHex())
+                 + QStringLiteral(".cache"))
+    , m_bundleMtime(-1)
+    , m_bundleSize(-1)
+{
+}
+
+QString CertificatePrivate::* const *CertificateCache::stringFields()
+{
+    static QString CertificatePrivate::* const fields[StringCount] = {
+        &CertificatePrivate::commonName,
+        &CertificatePrivate::countryName,
+        &CertificatePrivate::organizationName,
+        &CertificatePrivate::organizationalUnitName,
+        &CertificatePrivate::primaryName,
+        &CertificatePrivate::secondaryName,
+        &CertificatePrivate::issuerDisplayName,
+    };
+    return fields;
+}
+
+QByteArray CertificateCache::hash(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha256);
+}
+
+bool CertificateCache::load(QList<Certificate> *certificates, QByteArray *bundleData)
+{
+    struct stat st;
+    if (::stat(QFile::encodeName(m_bundlePath).constData(), &st) < 0) {
+        return false;
+    }
+    m_bundleMtime = qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    m_bundleSize = st.st_size;
+
+    QFile file(m_filePath);
+    const uchar *data = 0;
+    const qint64 size = file.size();
+    if (size >= qint64(sizeof(Header)) && file.open(QIODevice::ReadOnly)) {
+        data = file.map(0, size);
+    }
+
+    const Header *header = reinterpret_cast<const Header *>(data);
+    bool valid = header
+            && header->magic == CacheMagic
+            && header->version == CacheVersion
+            && qint64(sizeof(Header)) + qint64(header->count) * qint64(sizeof(Record))
+                + qint64(header->poolLength) * qint64(sizeof(QChar)) == size;
+
+    bool restamp = false;
+    if (valid && (header->bundleMtime != m_bundleMtime || header->bundleSize != m_bundleSize)) {
+        valid = readBundle(m_bundlePath, bundleData)
+                && hash(*bundleData) == QByteArray::fromRawData(header->bundleHash, HashLength);
+        restamp = valid;
+    }
+
+    if (valid) {
+        const Record *records = reinterpret_cast<const Record *>(data + sizeof(Header));
+        const QChar *pool = reinterpret_cast<const QChar *>(records + header->count);
+        QString CertificatePrivate::* const *fields = stringFields();
+
+        QList<Certificate> cached;
+        cached.reserve(header->count);
+        const QSharedPointer<CertificateBundleX509s> bundle(new CertificateBundleX509s(m_bundlePath));
+        for (quint32 i = 0; i < header->count && valid; ++i) {
+            const Record &record(records[i]);
+
+            Certificate certificate;
+            for (int j = 0; j < StringCount; ++j) {
+                const String &s(record.strings[j]);
+                if (quint64(s.offset) + s.length > header->poolLength) {
+                    valid = false;
+                    break;
+                }
+                certificate.d.data()->*fields[j] = QString(pool + s.offset, s.length);
+            }
+            certificate.d->notValidBefore = fromTime(record.notValidBefore, record.notValidBeforeOffset);
+            certificate.d->notValidAfter = fromTime(record.notValidAfter, record.notValidAfterOffset);
+            certificate.d->fingerprint = QByteArray(record.fingerprint, HashLength);
+            certificate.d->subjectNameHash = record.subjectNameHash;
+            certificate.d->issuerNameHash = record.issuerNameHash;
+            certificate.d->subjectKeyIdentifier = fromKeyIdentifier(record.subjectKeyIdentifier, record.subjectKeyIdentifierLength);
+            certificate.d->authorityKeyIdentifier = fromKeyIdentifier(record.authorityKeyIdentifier, record.authorityKeyIdentifierLength);
+            certificate.d->bundle = bundle;
+            certificate.d->pemOffset = record.pemOffset;
+            certificate.d->pemLength = record.pemLength;
+            cached.append(certificate);
+        }
+
+        if (valid) {
+            *certificates = cached;
+        }
+    }
+
+    if (data) {
+        file.unmap(const_cast<uchar *>(data));
+    }
+
+    if (!valid) {
+        if (bundleData->isEmpty()) {
+            readBundle(m_bundlePath, bundleData);
+        }
+        return false;
+    }
+
+    if (restamp) {
+        save(*certificates, *bundleData);
+    }
+    return true;
+}
+
+void CertificateCache::save(const QList<Certificate> &certificates, const QByteArray &bundleData)
+{
+    if (m_bundleSize < 0 || bundleData.size() != m_bundleSize) {
+        // Changed while it was read, or never stamped
+        return;
+    }
+
+    QString CertificatePrivate::* const *fields = stringFields();
+    const QHash<QByteArray, QPair<quint32, quint32> > blocks(pemBlocks(bundleData));
+
+    QString pool;
+    QByteArray records;
+    records.reserve(certificates.count() * sizeof(Record));
+    foreach (const Certificate &certificate, certificates) {
+        Record record;
+        memset(&record, 0, sizeof(record));
+        for (int j = 0; j < StringCount; ++j) {
+            const QString &s(certificate.d.data()->*fields[j]);
+            record.strings[j].offset = pool.length();
+            record.strings[j].length = s.length();
+            pool.append(s);
+        }
+        record.notValidBefore = toTime(certificate.d->notValidBefore);
+        record.notValidAfter = toTime(certificate.d->notValidAfter);
+        record.notValidBeforeOffset = certificate.d->notValidBefore.offsetFromUtc();
+        record.notValidAfterOffset = certificate.d->notValidAfter.offsetFromUtc();
+        memcpy(record.fingerprint, certificate.d->fingerprint.constData(),
+               qMin(certificate.d->fingerprint.size(), HashLength));
+        record.subjectNameHash = certificate.d->subjectNameHash;
+        record.issuerNameHash = certificate.d->issuerNameHash;
+        toKeyIdentifier(certificate.d->subjectKeyIdentifier, record.subjectKeyIdentifier, &record.subjectKeyIdentifierLength);
+        toKeyIdentifier(certificate.d->authorityKeyIdentifier, record.authorityKeyIdentifier, &record.authorityKeyIdentifierLength);
+        const QPair<quint32, quint32> block(blocks.value(certificate.d->fingerprint));
+        record.pemOffset = block.first;
+        record.pemLength = block.second;
+        records.append(reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CacheMagic;
+    header.version = CacheVersion;
+    header.bundleMtime = m_bundleMtime;
+    header.bundleSize = m_bundleSize;
+    memcpy(header.bundleHash, hash(bundleData).constData(), HashLength);
+    header.count = certificates.count();
+    header.poolLength = pool.length();
+
+    QDir().mkpath(QFileInfo(m_filePath).absolutePath());
+
+    QSaveFile file(m_filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not save certificate cache:" << m_filePath << file.errorString();
+        return;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(records);
+    file.write(reinterpret_cast<const char *>(pool.constData()), pool.length() * sizeof(QChar));
+
+    if (!file.commit()) {
+        qWarning() << "Could not save certificate cache:" << m_filePath << file.errorString();
+    }
+}
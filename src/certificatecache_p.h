@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef CERTIFICATECACHE_P_H
+#define CERTIFICATECACHE_P_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+class Certificate;
+class CertificatePrivate;
+
+// Keeps the list level fields and the issuer lookup keys of the certificates
+// in a bundle, so that showing the bundle again needs no PEM or ASN.1 parsing.
+//
+// There is one cache file per bundle. It is stamped with the mtime and size
+// of the bundle, and with a hash of its contents. A stamp mismatch alone does
+// not invalidate the cache, as the system bundles are regenerated with the
+// same contents on every trust store update; only a hash mismatch does.
+//
+// The file is mapped and read in place. Certificates read from the cache have
+// no X509 attached, their details are parsed on demand from the PEM block the
+// cache records for each of them.
+class CertificateCache
+{
+public:
+    explicit CertificateCache(const QString &bundlePath);
+
+    // Returns the cached certificates if they are up to date. Otherwise
+    // returns false and, if the bundle has been read for checking, its
+    // contents in bundleData.
+    bool load(QList<Certificate> *certificates, QByteArray *bundleData);
+
+    // bundleData must be what the certificates were parsed from
+    void save(const QList<Certificate> &certificates, const QByteArray &bundleData);
+
+private:
+    static QString CertificatePrivate::* const *stringFields();
+    static QByteArray hash(const QByteArray &data);
+
+    QString m_bundlePath;
+    QString m_filePath;
+    qint64 m_bundleMtime;
+    qint64 m_bundleSize;
+};
+
+#endif /* CERTIFICATECACHE_P_H */
@@ -31,9 +31,18 @@
  */
 
 #include "certificatemodel.h"
+#include "certificatemodel_p.h"
+#include "certificatecache_p.h"
+#include "certificatetime_p.h"
 
+#include <QCoreApplication>
 #include <QFile>
+#include <QFileInfo>
+#include <QMutex>
 #include <QRegularExpression>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
 #include <QDebug>
 #include <functional>
 
@@ -80,6 +89,70 @@ struct X509Certificate
         return nameElement(X509_get_issuer_name(x509), nid);
     }
 
+    QByteArray fingerprint() const
+    {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        if (!X509_digest(x509, EVP_sha256(), digest, &length))
+            return QByteArray();
+        return QByteArray(reinterpret_cast<char *>(digest), length);
+    }
+
+    // Shares the certificate beyond the lifetime of the bundle it was read from
+    QSharedPointer<X509> reference() const
+    {
+        CRYPTO_add(&x509->references, 1, CRYPTO_LOCK_X509);
+        return QSharedPointer<X509>(x509, X509_free);
+    }
+
+    // Type and size of the public key, without printing it
+    void publicKeyProperties(int *type, int *bits) const
+    {
+        *type = NID_undef;
+        *bits = 0;
+        if (EVP_PKEY *key = X509_get_pubkey(x509)) {
+            *type = EVP_PKEY_type(EVP_PKEY_id(key));
+            *bits = EVP_PKEY_bits(key);
+            EVP_PKEY_free(key);
+        }
+    }
+
+    QByteArray subjectKeyIdentifier() const
+    {
+        QByteArray rv;
+        if (ASN1_OCTET_STRING *id = static_cast<ASN1_OCTET_STRING *>(X509_get_ext_d2i(x509, NID_subject_key_identifier, 0, 0))) {
+            rv = QByteArray(reinterpret_cast<char *>(ASN1_STRING_data(id)), ASN1_STRING_length(id));
+            ASN1_OCTET_STRING_free(id);
+        }
+        return rv;
+    }
+
+    QByteArray authorityKeyIdentifier() const
+    {
+        QByteArray rv;
+        if (AUTHORITY_KEYID *id = static_cast<AUTHORITY_KEYID *>(X509_get_ext_d2i(x509, NID_authority_key_identifier, 0, 0))) {
+            if (id->keyid)
+                rv = QByteArray(reinterpret_cast<char *>(ASN1_STRING_data(id->keyid)), ASN1_STRING_length(id->keyid));
+            AUTHORITY_KEYID_free(id);
+        }
+        return rv;
+    }
+
+    quint32 subjectNameHash() const
+    {
+        return X509_subject_name_hash(x509);
+    }
+
+    quint32 issuerNameHash() const
+    {
+        return X509_issuer_name_hash(x509);
+    }
+
+    int signatureAlgorithm() const
+    {
+        return OBJ_obj2nid(x509->sig_alg->algorithm);
+    }
+
     QString version() const
     {
         return QString::number(X509_get_version(x509) + 1);
@@ -169,11 +242,6 @@ private:
         return QString::fromUtf8(reinterpret_cast<char*>(ASN1_STRING_data(data)));
     }
 
-    static QString timeToString(ASN1_TIME *data)
-    {
-        return stringToString(data);
-    }
-
     static QString idToString(int nid, bool shortForm)
     {
         return QString::fromUtf8(shortForm ? OBJ_nid2sn(nid) : OBJ_nid2ln(nid));
@@ -252,61 +320,8 @@ private:
 
     static QDateTime toDateTime(ASN1_TIME *time)
     {
-        const QString ts(timeToString(time));
-        return (time->type == V_ASN1_GENERALIZEDTIME ? fromGENERALIZEDTIME(ts) : fromUTCTIME(ts));
-    }
-
-    static QDateTime fromUTCTIME(const QString &ts)
-    {
-        QDate d;
-        QTime t;
-        int offset = 0;
-
-        // "YYMMDDhhmm[ss](Z|(+|-)hhmm)"
-        const QRegularExpression re("([0-9]{2})([0-9]{2})([0-9]{2})([0-9]{2})([0-9]{2})([0-9]{2})?(Z)?(([+-])([0-9]{2})([0-9]{2}))?");
-        QRegularExpressionMatch match = re.match(ts);
-        if (match.hasMatch()) {
-            int y = match.captured(1).toInt();
-            d = QDate((y < 70 ? 2000 : 1900) + y, match.captured(2).toInt(), match.captured(3).toInt());
-
-            t = QTime(match.captured(4).toInt(), match.captured(5).toInt(), match.captured(6).toInt());
-
-            if (match.lastCapturedIndex() > 7) {
-                offset = match.captured(11).toInt() * 60 + match.captured(10).toInt() * 60*60;
-                if (match.captured(9) == "-") {
-                    offset = -offset;
-                }
-            }
-        }
-
-        return QDateTime(d, t, Qt::OffsetFromUTC, offset);
-    }
-
-    static QDateTime fromGENERALIZEDTIME(const QString &ts)
-    {
-        QDate d;
-        QTime t;
-        int offset = 0;
-
-        // "YYYYMMDDhh[mm[ss[.fff]]](Z|(+|-)hhmm)" <- nested optionals can be treated as appearing sequentially
-        const QRegularExpression re("([0-9]{4})([0-9]{2})([0-9]{2})([0-9]{2})([0-9]{2})?([0-9]{2})?(\\.[0-9]{1,3})?(Z)?(([+-])([0-9]{2})([0-9]{2}))?");
-        QRegularExpressionMatch match = re.match(ts);
-        if (match.hasMatch()) {
-            d = QDate(match.captured(1).toInt(), match.captured(2).toInt(), match.captured(3).toInt());
-
-            double fraction = match.captured(7).toDouble();
-            int ms = (fraction * 1000);
-            t = QTime(match.captured(4).toInt(), match.captured(5).toInt(), match.captured(6).toInt(), ms);
-
-            if (match.lastCapturedIndex() > 8) {
-                offset = match.captured(12).toInt() * 60 + match.captured(11).toInt() * 60*60;
-                if (match.captured(10) == "-") {
-                    offset = -offset;
-                }
-            }
-        }
-
-        return QDateTime(d, t, Qt::OffsetFromUTC, offset);
+        return CertificateTime::decode(reinterpret_cast<const char *>(ASN1_STRING_data(time)),
+                                       ASN1_STRING_length(time), time->type == V_ASN1_GENERALIZEDTIME);
     }
 
     static QList<QPair<QString, QString>> parseData(QString data)
@@ -328,6 +343,8 @@ private:
     }
 
     friend struct ::X509List;
+    friend class ::Certificate;
+    friend class ::CertificateAnalysisJob;
 
     X509Certificate(X509 *x) : x509(x) {}
 
@@ -377,7 +394,7 @@ struct X509List
             PKCS7_free(pkcs7);
         */
         if (certificateStack)
-            sk_X509_free(certificateStack);
+            sk_X509_pop_free(certificateStack, X509_free);
         if (crlStack)
             sk_X509_CRL_free(crlStack);
     }
@@ -397,6 +414,11 @@ struct X509List
         sk_X509_push(certificateStack, x509);
     }
 
+    X509Certificate at(int index) const
+    {
+        return X509Certificate(sk_X509_value(certificateStack, index));
+    }
+
     void for_each(std::function<void (const X509Certificate &)> fn) const
     {
         for (int i = 0, n(count()); i < n; ++i) {
@@ -500,10 +522,23 @@ class LibCrypto
             OpenSSL_add_all_algorithms();
             ERR_load_crypto_strings();
             OPENSSL_config(NULL);
+
+            // Bundles are parsed on worker threads. Leave any locking set up by
+            // others, e.g. QtNetwork, in place
+            if (!CRYPTO_get_locking_callback()) {
+                locks = new QMutex[CRYPTO_num_locks()];
+                CRYPTO_set_locking_callback(lock);
+            }
         }
 
         ~Initializer()
         {
+            if (CRYPTO_get_locking_callback() == lock) {
+                CRYPTO_set_locking_callback(NULL);
+            }
+            delete [] locks;
+            locks = 0;
+
             FIPS_mode_set(0);
             ENGINE_cleanup();
             CONF_modules_unload(1);
@@ -512,6 +547,17 @@ class LibCrypto
             ERR_remove_thread_state(NULL);
             ERR_free_strings();
         }
+
+        static void lock(int mode, int type, const char *, int)
+        {
+            if (mode & CRYPTO_LOCK) {
+                locks[type].lock();
+            } else {
+                locks[type].unlock();
+            }
+        }
+
+        static QMutex *locks;
     };
 
     static Initializer init;
@@ -524,6 +570,57 @@ public:
 
         return bundleToCertificates(bundle);
     }
+
+    // Only parses the certificates that are not known by their fingerprint
+    static QList<Certificate> getCertificates(const QByteArray &bundleData, const QHash<QByteArray, Certificate> &known)
+    {
+        QList<Certificate> certificates;
+
+        PKCS7File bundle(bundleData);
+        if (bundle.isValid()) {
+            bundle.getCertificates().for_each([&certificates, &known](const X509Certificate &cert) {
+                const QHash<QByteArray, Certificate>::const_iterator it = known.constFind(cert.fingerprint());
+                certificates.append(it != known.constEnd() ? *it : Certificate(cert));
+            });
+        }
+
+        return certificates;
+    }
+
+    // Every certificate of the bundle by its fingerprint
+    static QHash<QByteArray, QSharedPointer<X509> > getX509s(const QString &bundlePath)
+    {
+        QHash<QByteArray, QSharedPointer<X509> > rv;
+
+        PKCS7File bundle(bundlePath);
+        if (bundle.isValid()) {
+            bundle.getCertificates().for_each([&rv](const X509Certificate &cert) {
+                rv.insert(cert.fingerprint(), cert.reference());
+            });
+        }
+
+        return rv;
+    }
+
+    // Hands the certificates over in batches, until fn returns false
+    template<class T>
+    static void getCertificates(const T &bundleData, int batchSize, std::function<bool (QList<Certificate> &)> fn)
+    {
+        PKCS7File bundle(bundleData);
+        if (!bundle.isValid())
+            return;
+
+        const X509List &certs(bundle.getCertificates());
+        QList<Certificate> batch;
+        for (int i = 0, n = certs.count(); i < n; ++i) {
+            batch.append(Certificate(certs.at(i)));
+            if (batch.count() == batchSize || i == n - 1) {
+                if (!fn(batch))
+                    return;
+                batch.clear();
+            }
+        }
+    }
 private:
     static QList<Certificate> bundleToCertificates(PKCS7File &bundle)
     {
@@ -540,8 +637,64 @@ private:
 };
 
 
+QMutex *LibCrypto::Initializer::locks = 0;
 LibCrypto::Initializer LibCrypto::init;
 
+// Certificates handed over to the model at a time
+const int BatchSize = 20;
+
+// Milliseconds to wait for a changed bundle to settle before reloading it
+const int ReloadDelay = 500;
+
+// Certificates analysed by one pool task
+const int AnalysisChunkSize = 32;
+
+// Smallest key sizes not reported as short
+const int MinimumRsaBits = 2048;
+const int MinimumEcBits = 224;
+
+const int DefaultExpiryWarningDays = 30;
+
+// Longest issuer chain followed, in case of loops
+const int MaximumChainLength = 16;
+
+class AnalysisParseTask : public QRunnable
+{
+public:
+    explicit AnalysisParseTask(CertificateAnalysisJob *job) : m_job(job) {}
+
+    void run() { m_job->parse(); }
+
+private:
+    CertificateAnalysisJob *m_job;
+};
+
+class AnalysisChunkTask : public QRunnable
+{
+public:
+    AnalysisChunkTask(CertificateAnalysisJob *job, int first, int last) : m_job(job), m_first(first), m_last(last) {}
+
+    void run() { m_job->analyze(m_first, m_last); }
+
+private:
+    CertificateAnalysisJob *m_job;
+    int m_first;
+    int m_last;
+};
+
+bool lessThan(const Certificate &lhs, const Certificate &rhs)
+{
+    int c = lhs.primaryName().compare(rhs.primaryName(), Qt::CaseInsensitive);
+    if (c < 0)
+        return true;
+    if (c > 0)
+        return false;
+    c = lhs.secondaryName().compare(rhs.secondaryName(), Qt::CaseInsensitive);
+    if (c < 0)
+        return true;
+    return false;
+}
+
 const QList<QPair<QString, CertificateModel::BundleType> > &bundlePaths()
 {
     static QList<QPair<QString, CertificateModel::BundleType> > paths;
@@ -581,25 +734,64 @@ QString bundlePath(CertificateModel::BundleType type)
     return QStringLiteral("");
 }
 
+QVariantMap chainEntry(const Certificate &certificate)
+{
+    QVariantMap entry;
+    entry.insert(QStringLiteral("primaryName"), certificate.primaryName());
+    entry.insert(QStringLiteral("secondaryName"), certificate.secondaryName());
+    entry.insert(QStringLiteral("organizationName"), certificate.organizationName());
+    entry.insert(QStringLiteral("fingerprint"), QString::fromLatin1(certificate.fingerprint().toHex()));
+    entry.insert(QStringLiteral("notValidBefore"), certificate.notValidBefore());
+    entry.insert(QStringLiteral("notValidAfter"), certificate.notValidAfter());
+    return entry;
+}
+
+// The whole bundle at once on the calling thread, from its cache if it can
+QList<Certificate> readCertificates(const QString &bundlePath)
+{
+    CertificateCache cache(bundlePath);
+    QList<Certificate> certificates;
+    QByteArray bundleData;
+    if (!cache.load(&certificates, &bundleData) && !bundleData.isEmpty()) {
+        certificates = LibCrypto::getCertificates(bundleData);
+        cache.save(certificates, bundleData);
+    }
+    std::stable_sort(certificates.begin(), certificates.end(), lessThan);
+    return certificates;
+}
+
+}
+
+Certificate::Certificate()
+    : d(new CertificatePrivate)
+{
 }
 
 Certificate::Certificate(const X509Certificate &cert)
-    : m_commonName(cert.subjectElement(NID_commonName))
-    , m_countryName(cert.subjectElement(NID_countryName))
-    , m_organizationName(cert.subjectElement(NID_organizationName))
-    , m_organizationalUnitName(cert.subjectElement(NID_organizationalUnitName))
-    , m_notValidBefore(cert.notBefore())
-    , m_notValidAfter(cert.notAfter())
+    : d(new CertificatePrivate)
 {
+    d->commonName = cert.subjectElement(NID_commonName);
+    d->countryName = cert.subjectElement(NID_countryName);
+    d->organizationName = cert.subjectElement(NID_organizationName);
+    d->organizationalUnitName = cert.subjectElement(NID_organizationalUnitName);
+    d->notValidBefore = cert.notBefore();
+    d->notValidAfter = cert.notAfter();
+    d->fingerprint = cert.fingerprint();
+    d->subjectNameHash = cert.subjectNameHash();
+    d->issuerNameHash = cert.issuerNameHash();
+    d->subjectKeyIdentifier = cert.subjectKeyIdentifier();
+    d->authorityKeyIdentifier = cert.authorityKeyIdentifier();
+    d->x509 = cert.reference();
+
     // Yield consistent names for the certificates, despite inconsistent naming policy
-    QString Certificate::*members[] = { &Certificate::m_commonName, &Certificate::m_organizationalUnitName, &Certificate::m_organizationName, &Certificate::m_countryName };
+    QString CertificatePrivate::*members[] = { &CertificatePrivate::commonName, &CertificatePrivate::organizationalUnitName, &CertificatePrivate::organizationName, &CertificatePrivate::countryName };
     for (auto it = std::begin(members); it != std::end(members); ++it) {
-        const QString &s(this->*(*it));
+        const QString &s(d.data()->*(*it));
         if (!s.isEmpty()) {
-            if (m_primaryName.isEmpty()) {
-                m_primaryName = s;
-            } else if (m_secondaryName.isEmpty()) {
-                m_secondaryName = s;
+            if (d->primaryName.isEmpty()) {
+                d->primaryName = s;
+            } else if (d->secondaryName.isEmpty()) {
+                d->secondaryName = s;
                 break;
             }
         }
@@ -609,128 +801,976 @@ Certificate::Certificate(const X509Certificate &cert)
     // Returns a name that describes the issuer. It returns the CommonName if
     // available, otherwise falls back to the Organization or the first
     // OrganizationalUnitName.
-    m_issuerDisplayName = cert.issuerElement(NID_commonName);
-    if (m_issuerDisplayName.isEmpty()) {
-        m_issuerDisplayName = cert.issuerElement(NID_countryName);
+    d->issuerDisplayName = cert.issuerElement(NID_commonName);
+    if (d->issuerDisplayName.isEmpty()) {
+        d->issuerDisplayName = cert.issuerElement(NID_countryName);
     }
-    if (m_issuerDisplayName.isEmpty()) {
-        m_issuerDisplayName = cert.issuerElement(NID_organizationName);
+    if (d->issuerDisplayName.isEmpty()) {
+        d->issuerDisplayName = cert.issuerElement(NID_organizationName);
+    }
+}
+
+Certificate::Certificate(const Certificate &certificate)
+    : d(certificate.d)
+{
+}
+
+Certificate &Certificate::operator =(const Certificate &certificate)
+{
+    d = certificate.d;
+    return *this;
+}
+
+Certificate::~Certificate()
+{
+}
+
+QString Certificate::commonName() const
+{
+    return d->commonName;
+}
+
+QString Certificate::countryName() const
+{
+    return d->countryName;
+}
+
+QString Certificate::organizationName() const
+{
+    return d->organizationName;
+}
+
+QString Certificate::organizationalUnitName() const
+{
+    return d->organizationalUnitName;
+}
+
+QString Certificate::primaryName() const
+{
+    return d->primaryName;
+}
+
+QString Certificate::secondaryName() const
+{
+    return d->secondaryName;
+}
+
+QDateTime Certificate::notValidBefore() const
+{
+    return d->notValidBefore;
+}
+
+QDateTime Certificate::notValidAfter() const
+{
+    return d->notValidAfter;
+}
+
+QString Certificate::issuerDisplayName() const
+{
+    return d->issuerDisplayName;
+}
+
+QByteArray Certificate::fingerprint() const
+{
+    return d->fingerprint;
+}
+
+QByteArray Certificate::subjectKeyIdentifier() const
+{
+    return d->subjectKeyIdentifier;
+}
+
+QByteArray Certificate::authorityKeyIdentifier() const
+{
+    return d->authorityKeyIdentifier;
+}
+
+quint32 Certificate::subjectNameHash() const
+{
+    return d->subjectNameHash;
+}
+
+quint32 Certificate::issuerNameHash() const
+{
+    return d->issuerNameHash;
+}
+
+QVariantMap Certificate::details() const
+{
+    // Shared by all copies, so built at most once per certificate. Copies
+    // may be used on other threads
+    QMutexLocker locker(&d->detailsMutex);
+    if (d->details.isEmpty()) {
+        if (!d->x509 && d->bundle) {
+            d->x509 = d->bundle->x509(d->fingerprint, d->pemOffset, d->pemLength);
+        }
+        if (d->x509) {
+            populateDetails();
+        }
     }
+    return d->details;
+}
 
-    // Populate the details map
-    m_details.insert(QStringLiteral("Version"), QVariant(cert.version()));
-    m_details.insert(QStringLiteral("SerialNumber"), QVariant(cert.serialNumber()));
-    m_details.insert(QStringLiteral("SubjectDisplayName"), QVariant(m_primaryName));
-    m_details.insert(QStringLiteral("OrganizationName"), QVariant(m_organizationName));
-    m_details.insert(QStringLiteral("IssuerDisplayName"), QVariant(m_issuerDisplayName));
+void Certificate::populateDetails() const
+{
+    const X509Certificate cert(d->x509.data());
+    QVariantMap &details(d->details);
+
+    details.insert(QStringLiteral("Version"), QVariant(cert.version()));
+    details.insert(QStringLiteral("SerialNumber"), QVariant(cert.serialNumber()));
+    details.insert(QStringLiteral("SubjectDisplayName"), QVariant(d->primaryName));
+    details.insert(QStringLiteral("OrganizationName"), QVariant(d->organizationName));
+    details.insert(QStringLiteral("IssuerDisplayName"), QVariant(d->issuerDisplayName));
 
     QVariantMap validity;
-    validity.insert(QStringLiteral("NotBefore"), QVariant(cert.notBefore()));
-    validity.insert(QStringLiteral("NotAfter"), QVariant(cert.notAfter()));
-    m_details.insert(QStringLiteral("Validity"), QVariant(validity));
+    validity.insert(QStringLiteral("NotBefore"), QVariant(d->notValidBefore));
+    validity.insert(QStringLiteral("NotAfter"), QVariant(d->notValidAfter));
+    details.insert(QStringLiteral("Validity"), QVariant(validity));
 
     QVariantMap issuer;
     const QList<QPair<QString, QString>> &issuerDetails(cert.issuerList());
     for (auto it = issuerDetails.cbegin(), end = issuerDetails.cend(); it != end; ++it) {
         issuer.insert(it->first, QVariant(it->second));
     }
-    m_details.insert(QStringLiteral("Issuer"), QVariant(issuer));
+    details.insert(QStringLiteral("Issuer"), QVariant(issuer));
 
     QVariantMap subject;
     const QList<QPair<QString, QString>> &subjectDetails(cert.subjectList());
     for (auto it = subjectDetails.cbegin(), end = subjectDetails.cend(); it != end; ++it) {
         subject.insert(it->first, QVariant(it->second));
     }
-    m_details.insert(QStringLiteral("Subject"), QVariant(subject));
+    details.insert(QStringLiteral("Subject"), QVariant(subject));
 
     QVariantMap publicKey;
     const QList<QPair<QString, QString>> &keyDetails(cert.publicKeyList());
     for (auto it = keyDetails.cbegin(), end = keyDetails.cend(); it != end; ++it) {
         publicKey.insert(it->first, QVariant(it->second));
     }
-    m_details.insert(QStringLiteral("SubjectPublicKeyInfo"), QVariant(publicKey));
+    details.insert(QStringLiteral("SubjectPublicKeyInfo"), QVariant(publicKey));
 
     QVariantMap extensions;
     const QList<QPair<QString, QString>> &extensionDetails(cert.extensionList());
     for (auto it = extensionDetails.cbegin(), end = extensionDetails.cend(); it != end; ++it) {
         extensions.insert(it->first, QVariant(it->second));
     }
-    m_details.insert(QStringLiteral("Extensions"), extensions);
+    details.insert(QStringLiteral("Extensions"), extensions);
 
     QVariantMap signature;
     const QList<QPair<QString, QString>> &signatureDetails(cert.signatureList());
     for (auto it = signatureDetails.cbegin(), end = signatureDetails.cend(); it != end; ++it) {
         signature.insert(it->first, QVariant(it->second));
     }
-    m_details.insert(QStringLiteral("Signature"), signature);
+    details.insert(QStringLiteral("Signature"), signature);
 }
 
-CertificateModel::CertificateModel(QObject *parent)
-    : QAbstractListModel(parent)
-    , m_type(NoBundle)
+CertificateBundleX509s::CertificateBundleX509s(const QString &bundlePath)
+    : m_bundlePath(bundlePath)
+    , m_parsed(false)
 {
 }
 
-CertificateModel::~CertificateModel()
+QSharedPointer<X509> CertificateBundleX509s::x509(const QByteArray &fingerprint, quint32 pemOffset, quint32 pemLength)
+{
+    if (pemLength > 0) {
+        QFile file(m_bundlePath);
+        if (file.open(QIODevice::ReadOnly) && file.seek(pemOffset)) {
+            PKCS7File block(file.read(pemLength));
+            if (block.count() == 1) {
+                const X509Certificate cert(block.getCertificates().at(0));
+                if (cert.fingerprint() == fingerprint)
+                    return cert.reference();
+            }
+        }
+        // The bundle has changed since, look through all of it
+    }
+
+    QMutexLocker locker(&m_mutex);
+
+    // Parsed once for all the certificates of the bundle that were read from the cache
+    if (!m_parsed) {
+        m_x509s = LibCrypto::getX509s(m_bundlePath);
+        m_parsed = true;
+    }
+
+    const QSharedPointer<X509> rv(m_x509s.value(fingerprint));
+    if (!rv)
+        qWarning() << "Certificate no longer found in:" << m_bundlePath;
+    return rv;
+}
+
+CertificateWorker::CertificateWorker(QObject *parent)
+    : QObject(parent)
+    , m_lastFinished(0)
 {
 }
 
-CertificateModel::BundleType CertificateModel::bundleType() const
+CertificateWorker::~CertificateWorker()
 {
-    return m_type;
 }
 
-void CertificateModel::setBundleType(BundleType type)
+void CertificateWorker::cancel(int request)
 {
-    if (m_type != type) {
-        m_type = type;
+    QMutexLocker locker(&m_cancelMutex);
+    // Requests are handled in order, so the ones up to the last finished
+    // one are done, even if the store has not heard of it yet
+    if (request > m_lastFinished)
+        m_cancelledRequests.insert(request);
+}
 
-        const QString path(::bundlePath(m_type));
-        if (!path.isNull())
-            setBundlePath(path);
+bool CertificateWorker::isCancelled(int request)
+{
+    QMutexLocker locker(&m_cancelMutex);
+    return m_cancelledRequests.contains(request);
+}
 
-        emit bundleTypeChanged();
+void CertificateWorker::load(const QString &bundlePath, int request)
+{
+    CertificateCache cache(bundlePath);
+    QList<Certificate> certificates;
+    QByteArray bundleData;
+    if (isCancelled(request)) {
+        // Released before it was started
+    } else if (cache.load(&certificates, &bundleData)) {
+        std::stable_sort(certificates.begin(), certificates.end(), lessThan);
+        emit loaded(certificates, request);
+    } else if (bundleData.isEmpty()) {
+        qWarning() << "Unable to read certificate bundle:" << bundlePath;
+    } else {
+        bool complete = true;
+        LibCrypto::getCertificates(bundleData, BatchSize, [this, request, &certificates, &complete](QList<Certificate> &batch) {
+            if (isCancelled(request)) {
+                complete = false;
+                return false;
+            }
+
+            certificates.append(batch);
+            std::stable_sort(batch.begin(), batch.end(), lessThan);
+            emit loaded(batch, request);
+            return true;
+        });
+
+        if (complete) {
+            cache.save(certificates, bundleData);
+        }
     }
+
+    finish(request);
 }
 
-QString CertificateModel::bundlePath() const
+void CertificateWorker::reload(const QString &bundlePath, const QList<Certificate> &current, int request)
 {
-    return m_path;
+    QHash<QByteArray, Certificate> known;
+    foreach (const Certificate &certificate, current)
+        known.insert(certificate.fingerprint(), certificate);
+
+    CertificateCache cache(bundlePath);
+    QList<Certificate> certificates;
+    QByteArray bundleData;
+    if (isCancelled(request)) {
+        // Superseded before it was started
+    } else if (cache.load(&certificates, &bundleData)) {
+        for (auto it = certificates.begin(), end = certificates.end(); it != end; ++it)
+            *it = known.value(it->fingerprint(), *it);
+        emit reloaded(certificates, request);
+    } else {
+        // A bundle that can no longer be read has no certificates left
+        if (!bundleData.isEmpty()) {
+            certificates = LibCrypto::getCertificates(bundleData, known);
+            cache.save(certificates, bundleData);
+        }
+        if (!isCancelled(request))
+            emit reloaded(certificates, request);
+    }
+
+    finish(request);
 }
 
-void CertificateModel::setBundlePath(const QString &path)
+void CertificateWorker::threadFinished()
 {
-    if (m_path != path) {
-        m_path = path;
-        refresh();
+    // The error queue of the thread is not freed by libcrypto otherwise
+    ERR_remove_thread_state(NULL);
+}
 
-        const BundleType type(::bundleType(m_path));
-        setBundleType(type);
+void CertificateWorker::finish(int request)
+{
+    {
+        QMutexLocker locker(&m_cancelMutex);
+        m_cancelledRequests.remove(request);
+        m_lastFinished = request;
+    }
+    emit finished(request);
+}
 
-        emit bundlePathChanged();
+QStringList CertificateSearchIndex::tokenize(const QString &text)
+{
+    QStringList tokens;
+
+    const QString folded(text.toCaseFolded());
+    int start = -1;
+    for (int i = 0, n = folded.length(); i <= n; ++i) {
+        if (i < n && folded.at(i).isLetterOrNumber()) {
+            if (start < 0)
+                start = i;
+        } else if (start >= 0) {
+            tokens.append(folded.mid(start, i - start));
+            start = -1;
+        }
     }
+
+    return tokens;
 }
 
-int CertificateModel::rowCount(const QModelIndex & parent) const
+QStringList CertificateSearchIndex::filterTerms(const QString &filter)
 {
-    Q_UNUSED(parent)
-    return m_certificates.count();
+    static const QRegularExpression fingerprint(QStringLiteral("^\\s*[0-9a-fA-F]{1,2}([\\s:]+[0-9a-fA-F]{1,2})+[\\s:]*$"));
+    static const QRegularExpression separators(QStringLiteral("[\\s:]"));
+
+    if (fingerprint.match(filter).hasMatch())
+        return tokenize(QString(filter).remove(separators));
+    return tokenize(filter);
 }
 
-QVariant CertificateModel::data(const QModelIndex &index, int role) const
+void CertificateSearchIndex::build(const QList<Certificate> &certificates)
 {
-    int row = index.row();
-    if (row < 0 || row >= m_certificates.count()) {
-        return QVariant();
+    m_tokens.clear();
+
+    for (int row = 0, n = certificates.count(); row < n; ++row) {
+        const Certificate &cert(certificates.at(row));
+
+        QStringList words;
+        words << tokenize(cert.primaryName())
+              << tokenize(cert.secondaryName())
+              << tokenize(cert.organizationName())
+              << tokenize(cert.issuerDisplayName());
+        words.append(QString::fromLatin1(cert.fingerprint().toHex()));
+        words.removeDuplicates();
+
+        foreach (const QString &word, words) {
+            const Token token = { word, row };
+            m_tokens.append(token);
+        }
     }
 
-    const Certificate &cert = m_certificates.at(row);
-    switch (role) {
-    case CommonNameRole:
-        return cert.commonName();
-    case CountryNameRole:
-        return cert.countryName();
-    case OrganizationNameRole:
+    std::sort(m_tokens.begin(), m_tokens.end());
+}
+
+void CertificateSearchIndex::narrow(const QString &term, QVector<bool> *matches) const
+{
+    QVector<bool> found(matches->count(), false);
+
+    const Token key = { term, 0 };
+    for (auto it = std::lower_bound(m_tokens.cbegin(), m_tokens.cend(), key);
+         it != m_tokens.cend() && it->text.startsWith(term); ++it) {
+        found[it->row] = true;
+    }
+
+    for (int row = 0, n = matches->count(); row < n; ++row) {
+        if (!found.at(row))
+            (*matches)[row] = false;
+    }
+}
+
+void CertificateIssuerIndex::add(const QList<Certificate> &certificates)
+{
+    foreach (const Certificate &certificate, certificates) {
+        const QByteArray fingerprint(certificate.fingerprint());
+        QHash<QByteArray, Entry>::iterator it = m_certificates.find(fingerprint);
+        if (it != m_certificates.end()) {
+            ++it->references;
+            continue;
+        }
+
+        const Entry entry = { certificate, 1 };
+        m_certificates.insert(fingerprint, entry);
+        if (!certificate.subjectKeyIdentifier().isEmpty())
+            m_subjectKeyIdentifiers.insert(certificate.subjectKeyIdentifier(), fingerprint);
+        m_subjectNameHashes.insert(certificate.subjectNameHash(), fingerprint);
+    }
+}
+
+void CertificateIssuerIndex::remove(const QList<Certificate> &certificates)
+{
+    foreach (const Certificate &certificate, certificates) {
+        const QByteArray fingerprint(certificate.fingerprint());
+        QHash<QByteArray, Entry>::iterator it = m_certificates.find(fingerprint);
+        if (it == m_certificates.end() || --it->references > 0)
+            continue;
+
+        m_certificates.erase(it);
+        m_subjectKeyIdentifiers.remove(certificate.subjectKeyIdentifier(), fingerprint);
+        m_subjectNameHashes.remove(certificate.subjectNameHash(), fingerprint);
+    }
+}
+
+bool CertificateIssuerIndex::isSelfIssued(const Certificate &certificate)
+{
+    return certificate.subjectNameHash() == certificate.issuerNameHash()
+            && (certificate.authorityKeyIdentifier().isEmpty()
+                || certificate.authorityKeyIdentifier() == certificate.subjectKeyIdentifier());
+}
+
+Certificate CertificateIssuerIndex::issuer(const Certificate &certificate) const
+{
+    // Of several matching issuers, e.g. a renewed CA, prefer the one valid the longest
+    Certificate rv;
+    auto consider = [&rv, &certificate, this](const QByteArray &fingerprint) {
+        if (fingerprint == certificate.fingerprint())
+            return;
+        const Certificate candidate(m_certificates.value(fingerprint).certificate);
+        if (candidate.subjectNameHash() != certificate.issuerNameHash())
+            return;
+        if (rv.fingerprint().isEmpty() || rv.notValidAfter() < candidate.notValidAfter())
+            rv = candidate;
+    };
+
+    const QByteArray authorityKeyIdentifier(certificate.authorityKeyIdentifier());
+    if (!authorityKeyIdentifier.isEmpty()) {
+        for (auto it = m_subjectKeyIdentifiers.constFind(authorityKeyIdentifier);
+             it != m_subjectKeyIdentifiers.constEnd() && it.key() == authorityKeyIdentifier; ++it) {
+            consider(*it);
+        }
+        if (!rv.fingerprint().isEmpty())
+            return rv;
+    }
+
+    // Issuers without a key identifier, or not matching it, by name only
+    for (auto it = m_subjectNameHashes.constFind(certificate.issuerNameHash());
+         it != m_subjectNameHashes.constEnd() && it.key() == certificate.issuerNameHash(); ++it) {
+        const QByteArray subjectKeyIdentifier(m_certificates.value(*it).certificate.subjectKeyIdentifier());
+        if (authorityKeyIdentifier.isEmpty() || subjectKeyIdentifier.isEmpty())
+            consider(*it);
+    }
+    return rv;
+}
+
+QList<Certificate> CertificateIssuerIndex::chain(const Certificate &certificate) const
+{
+    QList<Certificate> rv;
+
+    QSet<QByteArray> seen;
+    seen.insert(certificate.fingerprint());
+
+    Certificate current(certificate);
+    while (!isSelfIssued(current) && rv.count() < MaximumChainLength) {
+        const Certificate next(issuer(current));
+        if (next.fingerprint().isEmpty() || seen.contains(next.fingerprint()))
+            break;
+
+        rv.append(next);
+        seen.insert(next.fingerprint());
+        current = next;
+    }
+
+    return rv;
+}
+
+CertificateStore *CertificateStore::sharedInstance = nullptr;
+QExplicitlySharedDataPointer<CertificateStore> CertificateStore::pinnedInstance;
+
+CertificateStore::CertificateStore()
+    : m_thread(new QThread())
+    , m_worker(new CertificateWorker())
+    , m_lastRequest(0)
+{
+    Q_ASSERT(!sharedInstance);
+    sharedInstance = this;
+
+    qRegisterMetaType<QList<Certificate> >("QList<Certificate>");
+
+    m_worker->moveToThread(m_thread);
+
+    connect(m_worker, SIGNAL(loaded(QList<Certificate>, int)),
+            this, SLOT(certificatesLoaded(QList<Certificate>, int)));
+    connect(m_worker, SIGNAL(reloaded(QList<Certificate>, int)),
+            this, SLOT(certificatesReloaded(QList<Certificate>, int)));
+    connect(m_worker, SIGNAL(finished(int)), this, SLOT(loadFinished(int)));
+
+    m_reloadTimer.setInterval(ReloadDelay);
+    m_reloadTimer.setSingleShot(true);
+    connect(&m_reloadTimer, SIGNAL(timeout()), this, SLOT(reloadChanged()));
+    connect(&m_watcher, SIGNAL(fileChanged(QString)), this, SLOT(bundleChanged(QString)));
+    connect(&m_watcher, SIGNAL(directoryChanged(QString)), this, SLOT(directoryChanged(QString)));
+
+    // Emitted on the thread itself, right before it exits
+    connect(m_thread, SIGNAL(finished()), m_worker, SLOT(threadFinished()), Qt::DirectConnection);
+
+    m_thread->start();
+}
+
+CertificateStore::~CertificateStore()
+{
+    sharedInstance = nullptr;
+
+    // Abandon any bundle being loaded, so that the thread finishes soon. It
+    // must not be parsing anything when libcrypto is cleaned up at exit
+    for (QHash<int, QString>::const_iterator it = m_requests.cbegin(); it != m_requests.cend(); ++it) {
+        m_worker->cancel(it.key());
+    }
+    m_thread->quit();
+    m_thread->wait();
+
+    delete m_worker;
+    delete m_thread;
+}
+
+CertificateStore *CertificateStore::instance()
+{
+    return sharedInstance ? sharedInstance : new CertificateStore;
+}
+
+void CertificateStore::acquire(const QString &bundlePath)
+{
+    Bundle &bundle(m_bundles[bundlePath]);
+    if (bundle.users++ == 0 && !bundle.pinned)
+        load(bundlePath, &bundle);
+}
+
+void CertificateStore::load(const QString &bundlePath, Bundle *bundle)
+{
+    watch(bundlePath);
+
+    bundle->request = ++m_lastRequest;
+    m_requests.insert(bundle->request, bundlePath);
+    QMetaObject::invokeMethod(m_worker, "load", Qt::QueuedConnection,
+                              Q_ARG(QString, bundlePath), Q_ARG(int, bundle->request));
+}
+
+void CertificateStore::release(const QString &bundlePath)
+{
+    QHash<QString, Bundle>::iterator it = m_bundles.find(bundlePath);
+    if (it != m_bundles.end() && --it->users == 0 && !it->pinned) {
+        if (m_requests.remove(it->request)) {
+            m_worker->cancel(it->request);
+        }
+        m_changedBundles.remove(bundlePath);
+        m_issuers.remove(it->certificates);
+        m_bundles.erase(it);
+        unwatch(bundlePath);
+    }
+}
+
+QList<Certificate> CertificateStore::issuerChain(const Certificate &certificate, const QList<Certificate> &intermediates)
+{
+    if (!pinnedInstance)
+        pin();
+
+    // The index counts references, the intermediates go away with this call
+    m_issuers.add(intermediates);
+    const QList<Certificate> rv(m_issuers.chain(certificate));
+    m_issuers.remove(intermediates);
+    return rv;
+}
+
+void CertificateStore::pin()
+{
+    // Chains usually end in the system bundles, keep those loaded and watched
+    // even when no model shows them. The store holding them is kept until the
+    // application quits, rather than reloaded for every chain. They are loaded
+    // on the worker thread like any other bundle, issuersChanged() tells when,
+    // unless loadPinned() finishes them first
+    pinnedInstance = this;
+    qAddPostRoutine(unpin);
+
+    const QList<QPair<QString, CertificateModel::BundleType> > &bundles(bundlePaths());
+    for (auto it = bundles.cbegin(), end = bundles.cend(); it != end; ++it) {
+        Bundle &bundle(m_bundles[it->first]);
+        if (bundle.pinned)
+            continue;
+
+        bundle.pinned = true;
+        if (bundle.users == 0)
+            load(it->first, &bundle);
+    }
+}
+
+void CertificateStore::unpin()
+{
+    pinnedInstance.reset();
+}
+
+void CertificateStore::loadPinned()
+{
+    if (!pinnedInstance)
+        pin();
+
+    bool loaded = false;
+    for (QHash<QString, Bundle>::iterator it = m_bundles.begin(); it != m_bundles.end(); ++it) {
+        if (!it->pinned || !m_requests.remove(it->request))
+            continue;
+
+        // Whatever the worker has handed over already is kept
+        m_worker->cancel(it->request);
+        update(it.key(), &*it, readCertificates(it.key()));
+        loaded = true;
+    }
+
+    if (loaded)
+        emit issuersChanged();
+}
+
+QList<Certificate> CertificateStore::certificates(const QString &bundlePath) const
+{
+    return m_bundles.value(bundlePath).certificates;
+}
+
+void CertificateStore::watch(const QString &bundlePath)
+{
+    if (QFile::exists(bundlePath))
+        m_watcher.addPath(bundlePath);
+
+    const QString directory(QFileInfo(bundlePath).absolutePath());
+    if (!m_watcher.directories().contains(directory) && QFile::exists(directory))
+        m_watcher.addPath(directory);
+}
+
+void CertificateStore::unwatch(const QString &bundlePath)
+{
+    m_watcher.removePath(bundlePath);
+
+    // The directory stays watched while it holds other bundles
+    const QString directory(QFileInfo(bundlePath).absolutePath());
+    for (QHash<QString, Bundle>::const_iterator it = m_bundles.cbegin(); it != m_bundles.cend(); ++it) {
+        if (QFileInfo(it.key()).absolutePath() == directory)
+            return;
+    }
+    m_watcher.removePath(directory);
+}
+
+CertificateStore::Bundle *CertificateStore::requestBundle(int request, QString *bundlePath)
+{
+    QHash<int, QString>::const_iterator it = m_requests.constFind(request);
+    if (it == m_requests.constEnd())
+        return 0;
+
+    *bundlePath = *it;
+    QHash<QString, Bundle>::iterator bundle = m_bundles.find(*bundlePath);
+    if (bundle == m_bundles.end() || bundle->request != request)
+        return 0;
+
+    return &*bundle;
+}
+
+void CertificateStore::insert(const QString &bundlePath, QList<Certificate> *list, const QList<Certificate> &certificates)
+{
+    // The certificates are sorted, insert each run that lands between the same two rows at once.
+    // Inserting after equal rows keeps the order of the bundle for them
+    for (int i = 0, n = certificates.count(); i < n; ) {
+        const int row = std::upper_bound(list->cbegin(), list->cend(), certificates.at(i), lessThan) - list->cbegin();
+        int end = i + 1;
+        while (end < n && (row == list->count() || lessThan(certificates.at(end), list->at(row))))
+            ++end;
+
+        emit certificatesAboutToBeInserted(bundlePath, row, row + end - i - 1);
+        m_issuers.add(certificates.mid(i, end - i));
+        for (int j = i; j < end; ++j)
+            list->insert(row + j - i, certificates.at(j));
+        emit certificatesInserted(bundlePath);
+
+        i = end;
+    }
+}
+
+void CertificateStore::certificatesLoaded(const QList<Certificate> &certificates, int request)
+{
+    QString bundlePath;
+    if (Bundle *bundle = requestBundle(request, &bundlePath))
+        insert(bundlePath, &bundle->certificates, certificates);
+}
+
+void CertificateStore::certificatesReloaded(const QList<Certificate> &certificates, int request)
+{
+    QString bundlePath;
+    if (Bundle *bundle = requestBundle(request, &bundlePath))
+        update(bundlePath, bundle, certificates);
+}
+
+void CertificateStore::update(const QString &bundlePath, Bundle *bundle, const QList<Certificate> &certificates)
+{
+    // Counted, as a bundle may hold the same certificate more than once
+    QHash<QByteArray, int> wanted;
+    foreach (const Certificate &certificate, certificates)
+        ++wanted[certificate.fingerprint()];
+
+    QList<Certificate> &list(bundle->certificates);
+    QVector<bool> kept(list.count());
+    for (int i = list.count() - 1; i >= 0; --i) {
+        int &count(wanted[list.at(i).fingerprint()]);
+        kept[i] = count > 0;
+        if (kept.at(i))
+            --count;
+    }
+
+    // Remove the runs of certificates no longer in the bundle, from the end so that rows stay valid
+    for (int i = list.count() - 1; i >= 0; ) {
+        if (kept.at(i)) {
+            --i;
+            continue;
+        }
+
+        const int last = i;
+        while (i >= 0 && !kept.at(i))
+            --i;
+
+        emit certificatesAboutToBeRemoved(bundlePath, i + 1, last);
+        m_issuers.remove(list.mid(i + 1, last - i));
+        list.erase(list.begin() + i + 1, list.begin() + last + 1);
+        emit certificatesRemoved(bundlePath);
+    }
+
+    // What is still wanted is new
+    QList<Certificate> added;
+    foreach (const Certificate &certificate, certificates) {
+        int &count(wanted[certificate.fingerprint()]);
+        if (count > 0) {
+            added.append(certificate);
+            --count;
+        }
+    }
+    std::stable_sort(added.begin(), added.end(), lessThan);
+    insert(bundlePath, &list, added);
+}
+
+void CertificateStore::bundleChanged(const QString &bundlePath)
+{
+    // Replacing the file drops it from the watcher. When the new file is not
+    // there yet, directoryChanged() adds it back
+    if (!m_watcher.files().contains(bundlePath) && QFile::exists(bundlePath))
+        m_watcher.addPath(bundlePath);
+
+    // Bundles tend to be written more than once in a row
+    if (m_bundles.contains(bundlePath)) {
+        m_changedBundles.insert(bundlePath);
+        m_reloadTimer.start();
+    }
+}
+
+void CertificateStore::directoryChanged(const QString &directory)
+{
+    // A bundle that was removed, or whose watch was lost while it was being
+    // replaced, is picked up again once it shows up in its directory
+    for (QHash<QString, Bundle>::const_iterator it = m_bundles.cbegin(); it != m_bundles.cend(); ++it) {
+        if (QFileInfo(it.key()).absolutePath() != directory || m_watcher.files().contains(it.key())
+                || !QFile::exists(it.key()))
+            continue;
+
+        m_watcher.addPath(it.key());
+        m_changedBundles.insert(it.key());
+        m_reloadTimer.start();
+    }
+}
+
+void CertificateStore::reloadChanged()
+{
+    foreach (const QString &bundlePath, m_changedBundles) {
+        QHash<QString, Bundle>::iterator bundle = m_bundles.find(bundlePath);
+        if (bundle == m_bundles.end())
+            continue;
+
+        // A load still in progress is superseded, what it added so far is diffed too
+        if (m_requests.remove(bundle->request))
+            m_worker->cancel(bundle->request);
+
+        bundle->request = ++m_lastRequest;
+        m_requests.insert(bundle->request, bundlePath);
+        QMetaObject::invokeMethod(m_worker, "reload", Qt::QueuedConnection,
+                                  Q_ARG(QString, bundlePath),
+                                  Q_ARG(QList<Certificate>, bundle->certificates),
+                                  Q_ARG(int, bundle->request));
+    }
+    m_changedBundles.clear();
+}
+
+void CertificateStore::loadFinished(int request)
+{
+    // Chains looked up meanwhile may have been missing the issuers of this bundle
+    if (m_requests.remove(request))
+        emit issuersChanged();
+}
+
+CertificateModel::CertificateModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , m_type(NoBundle)
+    , m_store(CertificateStore::instance())
+    , m_index(new CertificateSearchIndex)
+    , m_changeFirst(0)
+    , m_changeLast(-1)
+{
+    connect(m_store.data(), SIGNAL(certificatesAboutToBeInserted(QString, int, int)),
+            this, SLOT(certificatesAboutToBeInserted(QString, int, int)));
+    connect(m_store.data(), SIGNAL(certificatesInserted(QString)),
+            this, SLOT(certificatesInserted(QString)));
+    connect(m_store.data(), SIGNAL(certificatesAboutToBeRemoved(QString, int, int)),
+            this, SLOT(certificatesAboutToBeRemoved(QString, int, int)));
+    connect(m_store.data(), SIGNAL(certificatesRemoved(QString)),
+            this, SLOT(certificatesRemoved(QString)));
+    connect(m_store.data(), SIGNAL(issuersChanged()), this, SIGNAL(issuersChanged()));
+}
+
+CertificateModel::~CertificateModel()
+{
+    if (!m_path.isEmpty())
+        m_store->release(m_path);
+}
+
+CertificateModel::BundleType CertificateModel::bundleType() const
+{
+    return m_type;
+}
+
+void CertificateModel::setBundleType(BundleType type)
+{
+    if (m_type != type) {
+        m_type = type;
+
+        const QString path(::bundlePath(m_type));
+        if (!path.isNull())
+            setBundlePath(path);
+
+        emit bundleTypeChanged();
+    }
+}
+
+QString CertificateModel::bundlePath() const
+{
+    return m_path;
+}
+
+QString CertificateModel::filter() const
+{
+    return m_filter;
+}
+
+void CertificateModel::setFilter(const QString &filter)
+{
+    if (m_filter == filter)
+        return;
+
+    m_filter = filter;
+
+    const QStringList terms(CertificateSearchIndex::filterTerms(filter));
+    bool narrowing = !m_filterTerms.isEmpty() && terms.count() >= m_filterTerms.count();
+    for (int i = 0; narrowing && i < m_filterTerms.count(); ++i)
+        narrowing = terms.at(i).startsWith(m_filterTerms.at(i));
+
+    if (terms == m_filterTerms) {
+        // Only the separators changed
+    } else if (narrowing) {
+        // Typing on can only drop rows, remove the runs that no longer match
+        const QVector<int> rows(matchingRows(terms, true));
+        m_filterTerms = terms;
+
+        int j = rows.count() - 1;
+        for (int i = m_rows.count() - 1; i >= 0; ) {
+            if (j >= 0 && rows.at(j) == m_rows.at(i)) {
+                --i;
+                --j;
+                continue;
+            }
+
+            const int last = i;
+            while (i >= 0 && (j < 0 || rows.at(j) != m_rows.at(i)))
+                --i;
+
+            beginRemoveRows(QModelIndex(), i + 1, last);
+            m_rows.remove(i + 1, last - i);
+            endRemoveRows();
+        }
+    } else {
+        beginResetModel();
+        m_rows = matchingRows(terms, false);
+        m_filterTerms = terms;
+        endResetModel();
+    }
+
+    emit filterChanged();
+}
+
+QVector<int> CertificateModel::matchingRows(const QStringList &terms, bool narrow) const
+{
+    QVector<int> rows;
+    if (terms.isEmpty())
+        return rows;
+
+    if (m_index->isEmpty())
+        m_index->build(m_certificates);
+
+    // When narrowing, only the current rows are candidates and only the
+    // terms that changed need to be looked up
+    QVector<bool> matches(m_certificates.count(), !narrow);
+    if (narrow) {
+        foreach (int row, m_rows)
+            matches[row] = true;
+    }
+    for (int i = 0; i < terms.count(); ++i) {
+        if (!narrow || i >= m_filterTerms.count() || terms.at(i) != m_filterTerms.at(i))
+            m_index->narrow(terms.at(i), &matches);
+    }
+
+    for (int row = 0, n = matches.count(); row < n; ++row) {
+        if (matches.at(row))
+            rows.append(row);
+    }
+    return rows;
+}
+
+QVector<int> CertificateModel::matchingRows(const QList<Certificate> &certificates, int first, int last) const
+{
+    // A throwaway index of the rows only, m_index covers the rows before the change
+    CertificateSearchIndex index;
+    index.build(certificates.mid(first, last - first + 1));
+
+    QVector<bool> matches(last - first + 1, true);
+    foreach (const QString &term, m_filterTerms)
+        index.narrow(term, &matches);
+
+    QVector<int> rows;
+    for (int i = 0, n = matches.count(); i < n; ++i) {
+        if (matches.at(i))
+            rows.append(first + i);
+    }
+    return rows;
+}
+
+void CertificateModel::setBundlePath(const QString &path)
+{
+    if (m_path != path) {
+        if (!m_path.isEmpty())
+            m_store->release(m_path);
+        m_path = path;
+        if (!m_path.isEmpty())
+            m_store->acquire(m_path);
+        refresh();
+
+        const BundleType type(::bundleType(m_path));
+        setBundleType(type);
+
+        emit bundlePathChanged();
+    }
+}
+
+int CertificateModel::rowCount(const QModelIndex & parent) const
+{
+    Q_UNUSED(parent)
+    return m_filterTerms.isEmpty() ? m_certificates.count() : m_rows.count();
+}
+
+QVariant CertificateModel::data(const QModelIndex &index, int role) const
+{
+    int row = index.row();
+    if (row < 0 || row >= rowCount()) {
+        return QVariant();
+    }
+    if (!m_filterTerms.isEmpty()) {
+        row = m_rows.at(row);
+    }
+
+    const Certificate &cert = m_certificates.at(row);
+    switch (role) {
+    case CommonNameRole:
+        return cert.commonName();
+    case CountryNameRole:
+        return cert.countryName();
+    case OrganizationNameRole:
         return cert.organizationName();
     case OrganizationalUnitNameRole:
         return cert.organizationalUnitName();
@@ -769,26 +1809,127 @@ QHash<int, QByteArray> CertificateModel::roleNames() const
 }
 void CertificateModel::refresh()
 {
+    // Whatever another model has loaded of the bundle already is shown at once
     beginResetModel();
-    if (m_path.isEmpty()) {
-        m_certificates.clear();
-    } else {
-        m_certificates = getCertificates(m_path);
-        std::stable_sort(m_certificates.begin(), m_certificates.end(), [](const Certificate &lhs, const Certificate &rhs) {
-            int c = lhs.primaryName().compare(rhs.primaryName(), Qt::CaseInsensitive);
-            if (c < 0)
-                return true;
-            if (c > 0)
-                return false;
-            c = lhs.secondaryName().compare(rhs.secondaryName(), Qt::CaseInsensitive);
-            if (c < 0)
-                return true;
-            return false;
-        });
-    }
+    m_certificates = m_store->certificates(m_path);
+    m_index->clear();
+    m_rows = matchingRows(m_filterTerms, false);
     endResetModel();
 }
 
+void CertificateModel::certificatesAboutToBeInserted(const QString &bundlePath, int first, int last)
+{
+    if (bundlePath != m_path)
+        return;
+
+    // Filtered rows are inserted once it is known which of the batch match
+    if (m_filterTerms.isEmpty())
+        beginInsertRows(QModelIndex(), first, last);
+    m_changeFirst = first;
+    m_changeLast = last;
+}
+
+void CertificateModel::certificatesInserted(const QString &bundlePath)
+{
+    if (bundlePath != m_path)
+        return;
+
+    // Shares the list of the store, the model never modifies it
+    const QList<Certificate> certificates(m_store->certificates(m_path));
+    const int count = m_changeLast - m_changeFirst + 1;
+
+    if (m_filterTerms.isEmpty()) {
+        m_certificates = certificates;
+        m_index->clear();
+        endInsertRows();
+        return;
+    }
+
+    // Only the batch is matched, the rows after it move down by its size
+    const QVector<int> matches(matchingRows(certificates, m_changeFirst, m_changeLast));
+    const int position = std::lower_bound(m_rows.cbegin(), m_rows.cend(), m_changeFirst) - m_rows.cbegin();
+
+    if (!matches.isEmpty())
+        beginInsertRows(QModelIndex(), position, position + matches.count() - 1);
+
+    m_certificates = certificates;
+    m_index->clear();
+    for (int i = position, n = m_rows.count(); i < n; ++i)
+        m_rows[i] += count;
+    m_rows.insert(position, matches.count(), 0);
+    std::copy(matches.cbegin(), matches.cend(), m_rows.begin() + position);
+
+    if (!matches.isEmpty())
+        endInsertRows();
+}
+
+void CertificateModel::certificatesAboutToBeRemoved(const QString &bundlePath, int first, int last)
+{
+    if (bundlePath != m_path)
+        return;
+
+    m_changeFirst = first;
+    m_changeLast = last;
+    if (m_filterTerms.isEmpty()) {
+        beginRemoveRows(QModelIndex(), first, last);
+        return;
+    }
+
+    // m_rows is sorted, the filtered rows removed are the ones in between
+    const int begin = std::lower_bound(m_rows.cbegin(), m_rows.cend(), first) - m_rows.cbegin();
+    const int end = std::lower_bound(m_rows.cbegin(), m_rows.cend(), last + 1) - m_rows.cbegin();
+    if (begin < end)
+        beginRemoveRows(QModelIndex(), begin, end - 1);
+}
+
+void CertificateModel::certificatesRemoved(const QString &bundlePath)
+{
+    if (bundlePath != m_path)
+        return;
+
+    m_certificates = m_store->certificates(m_path);
+    m_index->clear();
+
+    if (m_filterTerms.isEmpty()) {
+        endRemoveRows();
+        return;
+    }
+
+    const int count = m_changeLast - m_changeFirst + 1;
+    const int begin = std::lower_bound(m_rows.cbegin(), m_rows.cend(), m_changeFirst) - m_rows.cbegin();
+    const int end = std::lower_bound(m_rows.cbegin(), m_rows.cend(), m_changeLast + 1) - m_rows.cbegin();
+    m_rows.remove(begin, end - begin);
+    for (int i = begin, n = m_rows.count(); i < n; ++i)
+        m_rows[i] -= count;
+
+    if (begin < end)
+        endRemoveRows();
+}
+
+QVariantList CertificateModel::issuerChainAt(int row) const
+{
+    QVariantList rv;
+    if (row < 0 || row >= rowCount())
+        return rv;
+
+    const QList<Certificate> chain(m_store->issuerChain(m_certificates.at(m_filterTerms.isEmpty() ? row : m_rows.at(row))));
+    foreach (const Certificate &issuer, chain)
+        rv.append(chainEntry(issuer));
+    return rv;
+}
+
+QList<Certificate> CertificateModel::issuerChain(const Certificate &certificate)
+{
+    return issuerChain(certificate, QList<Certificate>());
+}
+
+QList<Certificate> CertificateModel::issuerChain(const Certificate &certificate, const QList<Certificate> &intermediates)
+{
+    QExplicitlySharedDataPointer<CertificateStore> store(CertificateStore::instance());
+    store->loadPinned();
+    return store->issuerChain(certificate, intermediates);
+}
+
 QList<Certificate> CertificateModel::getCertificates(const QString &bundlePath)
 {
     return LibCrypto::getCertificates(bundlePath);
@@ -798,3 +1939,204 @@ QList<Certificate> CertificateModel::getCertificates(const QByteArray &pem)
 {
     return LibCrypto::getCertificates(pem);
 }
+
+CertificateAnalysisJob::CertificateAnalysisJob(const QString &bundlePath, const QDateTime &now, int expiryWarningDays)
+    : m_bundlePath(bundlePath)
+    , m_now(now)
+    , m_warningLimit(now.addDays(expiryWarningDays))
+{
+}
+
+void CertificateAnalysisJob::start()
+{
+    QThreadPool::globalInstance()->start(new AnalysisParseTask(this));
+}
+
+void CertificateAnalysisJob::parse()
+{
+    PKCS7File bundle(m_bundlePath);
+    if (bundle.isValid()) {
+        const X509List &certs(bundle.getCertificates());
+        m_certificates.reserve(certs.count());
+        for (int i = 0, n = certs.count(); i < n; ++i)
+            m_certificates.append(certs.at(i).reference());
+    }
+
+    const int count = m_certificates.count();
+    const int chunks = (count + AnalysisChunkSize - 1) / AnalysisChunkSize;
+    if (chunks == 0) {
+        complete();
+        return;
+    }
+
+    m_pendingChunks.store(chunks);
+    for (int chunk = 1; chunk < chunks; ++chunk) {
+        QThreadPool::globalInstance()->start(new AnalysisChunkTask(
+                this, chunk * AnalysisChunkSize, qMin(count, (chunk + 1) * AnalysisChunkSize)));
+    }
+    analyze(0, qMin(count, AnalysisChunkSize));
+}
+
+void CertificateAnalysisJob::analyze(int first, int last)
+{
+    QList<Entry> entries;
+    for (int i = first; i < last; ++i) {
+        const X509Certificate cert(m_certificates.at(i).data());
+        const Certificate certificate(cert);
+
+        int keyType = NID_undef;
+        int keyBits = 0;
+        cert.publicKeyProperties(&keyType, &keyBits);
+        const int signature = cert.signatureAlgorithm();
+
+        CertificateAnalyzer::Weaknesses weaknesses(CertificateAnalyzer::NoWeakness);
+        if (((keyType == EVP_PKEY_RSA || keyType == EVP_PKEY_DSA) && keyBits < MinimumRsaBits)
+                || (keyType == EVP_PKEY_EC && keyBits < MinimumEcBits)) {
+            weaknesses |= CertificateAnalyzer::ShortKey;
+        }
+        int digest = NID_undef;
+        if (OBJ_find_sigid_algs(signature, &digest, 0)
+                && (digest == NID_md2 || digest == NID_md4 || digest == NID_md5 || digest == NID_sha1)) {
+            weaknesses |= CertificateAnalyzer::WeakSignatureHash;
+        }
+
+        const QDateTime notValidBefore(certificate.notValidBefore());
+        const QDateTime notValidAfter(certificate.notValidAfter());
+        CertificateAnalyzer::Validity validity = CertificateAnalyzer::Valid;
+        if (notValidBefore.isValid() && m_now < notValidBefore) {
+            validity = CertificateAnalyzer::NotYetValid;
+        } else if (notValidAfter.isValid() && notValidAfter < m_now) {
+            validity = CertificateAnalyzer::Expired;
+        } else if (notValidAfter.isValid() && notValidAfter < m_warningLimit) {
+            validity = CertificateAnalyzer::ExpiringSoon;
+        }
+
+        QVariantMap report;
+        report.insert(QStringLiteral("primaryName"), certificate.primaryName());
+        report.insert(QStringLiteral("secondaryName"), certificate.secondaryName());
+        report.insert(QStringLiteral("organizationName"), certificate.organizationName());
+        report.insert(QStringLiteral("fingerprint"), QString::fromLatin1(certificate.fingerprint().toHex()));
+        report.insert(QStringLiteral("notValidBefore"), notValidBefore);
+        report.insert(QStringLiteral("notValidAfter"), notValidAfter);
+        report.insert(QStringLiteral("validity"), int(validity));
+        report.insert(QStringLiteral("keyAlgorithm"), keyType != NID_undef ? QString::fromLatin1(OBJ_nid2sn(keyType)) : QString());
+        report.insert(QStringLiteral("keyBits"), keyBits);
+        report.insert(QStringLiteral("signatureAlgorithm"), QString::fromLatin1(OBJ_nid2sn(signature)));
+        report.insert(QStringLiteral("weaknesses"), int(weaknesses));
+
+        const Entry entry = { notValidAfter, report, weaknesses != CertificateAnalyzer::NoWeakness };
+        entries.append(entry);
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_entries.append(entries);
+    }
+
+    if (!m_pendingChunks.deref())
+        complete();
+}
+
+void CertificateAnalysisJob::complete()
+{
+    // Soonest expiry first, certificates without a valid expiry last
+    std::stable_sort(m_entries.begin(), m_entries.end(), [](const Entry &lhs, const Entry &rhs) {
+        if (!rhs.notValidAfter.isValid())
+            return lhs.notValidAfter.isValid();
+        return lhs.notValidAfter.isValid() && lhs.notValidAfter < rhs.notValidAfter;
+    });
+
+    QVariantList expiryTimeline;
+    QVariantList weakCertificates;
+    foreach (const Entry &entry, m_entries) {
+        expiryTimeline.append(entry.report);
+        if (entry.weak)
+            weakCertificates.append(entry.report);
+    }
+
+    emit finished(expiryTimeline, weakCertificates);
+    deleteLater();
+}
+
+CertificateAnalyzer::CertificateAnalyzer(QObject *parent)
+    : QObject(parent)
+    , m_expiryWarningDays(DefaultExpiryWarningDays)
+    , m_job(0)
+{
+}
+
+CertificateAnalyzer::~CertificateAnalyzer()
+{
+    // A running job finishes on its own and deletes itself
+    if (m_job)
+        m_job->disconnect(this);
+}
+
+QString CertificateAnalyzer::bundlePath() const
+{
+    return m_path;
+}
+
+void CertificateAnalyzer::setBundlePath(const QString &path)
+{
+    if (m_path != path) {
+        m_path = path;
+        emit bundlePathChanged();
+    }
+}
+
+int CertificateAnalyzer::expiryWarningDays() const
+{
+    return m_expiryWarningDays;
+}
+
+void CertificateAnalyzer::setExpiryWarningDays(int days)
+{
+    if (m_expiryWarningDays != days) {
+        m_expiryWarningDays = days;
+        emit expiryWarningDaysChanged();
+    }
+}
+
+bool CertificateAnalyzer::working() const
+{
+    return m_job != 0;
+}
+
+QVariantList CertificateAnalyzer::expiryTimeline() const
+{
+    return m_expiryTimeline;
+}
+
+QVariantList CertificateAnalyzer::weakCertificates() const
+{
+    return m_weakCertificates;
+}
+
+void CertificateAnalyzer::analyze()
+{
+    const bool wasWorking = working();
+    if (m_job)
+        m_job->disconnect(this);
+
+    m_job = new CertificateAnalysisJob(m_path, QDateTime::currentDateTimeUtc(), m_expiryWarningDays);
+    connect(m_job, SIGNAL(finished(QVariantList, QVariantList)),
+            this, SLOT(jobFinished(QVariantList, QVariantList)));
+    m_job->start();
+
+    if (!wasWorking)
+        emit workingChanged();
+}
+
+void CertificateAnalyzer::jobFinished(const QVariantList &expiryTimeline, const QVariantList &weakCertificates)
+{
+    if (sender() != m_job)
+        return;
+
+    m_job = 0;
+    m_expiryTimeline = expiryTimeline;
+    m_weakCertificates = weakCertificates;
+
+    emit finished();
+    emit workingChanged();
+}
@@ -35,54 +35,73 @@
 
 #include <QAbstractListModel>
 #include <QDateTime>
+#include <QExplicitlySharedDataPointer>
 #include <QList>
+#include <QMetaType>
+#include <QScopedPointer>
+#include <QVector>
 #include <QVariantMap>
 
 #include "systemsettingsglobal.h"
 
 
 struct X509Certificate;
+struct x509_st;
+class CertificateAnalysisJob;
+class CertificatePrivate;
+class CertificateSearchIndex;
+class CertificateStore;
 
 class SYSTEMSETTINGS_EXPORT Certificate
 {
 public:
+    Certificate();
     Certificate(const X509Certificate &cert);
+    Certificate(const Certificate &certificate);
+    Certificate &operator =(const Certificate &certificate);
+    ~Certificate();
 
-    QString commonName() const { return m_commonName; }
-    QString countryName() const { return m_countryName; }
-    QString organizationName() const { return m_organizationName; }
-    QString organizationalUnitName() const { return m_organizationalUnitName; }
-    QString primaryName() const { return m_primaryName; }
-    QString secondaryName() const { return m_secondaryName; }
+    QString commonName() const;
+    QString countryName() const;
+    QString organizationName() const;
+    QString organizationalUnitName() const;
+    QString primaryName() const;
+    QString secondaryName() const;
 
-    QDateTime notValidBefore() const { return m_notValidBefore; }
-    QDateTime notValidAfter() const { return m_notValidAfter; }
+    QDateTime notValidBefore() const;
+    QDateTime notValidAfter() const;
 
-    QVariantMap details() const { return m_details; }
+    QVariantMap details() const;
 
-    QString issuerDisplayName() const { return m_issuerDisplayName; }
+    QString issuerDisplayName() const;
 
-private:
-    QString m_commonName;
-    QString m_countryName;
-    QString m_organizationName;
-    QString m_organizationalUnitName;
-    QString m_primaryName;
-    QString m_secondaryName;
+    // SHA-256 of the DER encoding
+    QByteArray fingerprint() const;
+
+    // Issuer lookup keys, the identifiers are empty when the extension is missing
+    QByteArray subjectKeyIdentifier() const;
+    QByteArray authorityKeyIdentifier() const;
+    quint32 subjectNameHash() const;
+    quint32 issuerNameHash() const;
 
-    QDateTime m_notValidBefore;
-    QDateTime m_notValidAfter;
+private:
+    friend class CertificateCache;
 
-    QString m_issuerDisplayName;
+    void populateDetails() const;
 
-    QVariantMap m_details;
+    // Copies share the parsed data, and the details once built
+    QExplicitlySharedDataPointer<CertificatePrivate> d;
 };
 
+Q_DECLARE_TYPEINFO(Certificate, Q_MOVABLE_TYPE);
+Q_DECLARE_METATYPE(Certificate)
+
 class SYSTEMSETTINGS_EXPORT CertificateModel: public QAbstractListModel
 {
     Q_OBJECT
     Q_PROPERTY(BundleType bundleType READ bundleType WRITE setBundleType NOTIFY bundleTypeChanged)
     Q_PROPERTY(QString bundlePath READ bundlePath WRITE setBundlePath NOTIFY bundlePathChanged)
+    Q_PROPERTY(QString filter READ filter WRITE setFilter NOTIFY filterChanged)
     Q_ENUMS(BundleType)
 
 public:
@@ -115,25 +134,140 @@ public:
     QString bundlePath() const;
     void setBundlePath(const QString &path);
 
+    // Only certificates with a word starting with each word of the filter are
+    // shown. Words are matched in the names, organization, issuer and the hex
+    // SHA-256 fingerprint, ignoring case.
+    QString filter() const;
+    void setFilter(const QString &filter);
+
     virtual int rowCount(const QModelIndex & parent = QModelIndex()) const;
     virtual QVariant data(const QModelIndex &index, int role) const;
 
+    // Issuers of the certificate in the rows, see issuerChain(). Ask again
+    // on issuersChanged()
+    Q_INVOKABLE QVariantList issuerChainAt(int row) const;
+
     static QList<Certificate> getCertificates(const QString &bundlePath);
     static QList<Certificate> getCertificates(const QByteArray &pem);
 
+    // The issuer of the certificate first, up to a self-issued root when one
+    // is known. Issuers are looked up in the system bundles and in all bundles
+    // loaded by models, by key identifier or else by subject name. The system
+    // bundles are loaded on first use, from their caches when possible, and
+    // the first call waits for them.
+    static QList<Certificate> issuerChain(const Certificate &certificate);
+    // Also looks up issuers in intermediates, e.g. the other certificates
+    // of the PEM the certificate came from
+    static QList<Certificate> issuerChain(const Certificate &certificate, const QList<Certificate> &intermediates);
+
 Q_SIGNALS:
     void bundleTypeChanged();
     void bundlePathChanged();
+    void filterChanged();
+    // More issuers are known, chains may have grown
+    void issuersChanged();
 
 protected:
     void refresh();
 
     QHash<int, QByteArray> roleNames() const;
 
+private slots:
+    void certificatesAboutToBeInserted(const QString &bundlePath, int first, int last);
+    void certificatesInserted(const QString &bundlePath);
+    void certificatesAboutToBeRemoved(const QString &bundlePath, int first, int last);
+    void certificatesRemoved(const QString &bundlePath);
+
 private:
+    QVector<int> matchingRows(const QStringList &terms, bool narrow) const;
+    // The rows from first to last of certificates that match the filter
+    QVector<int> matchingRows(const QList<Certificate> &certificates, int first, int last) const;
+
     BundleType m_type;
     QString m_path;
     QList<Certificate> m_certificates;
+    QExplicitlySharedDataPointer<CertificateStore> m_store;
+
+    QString m_filter;
+    QStringList m_filterTerms;
+    // Rows of m_certificates that match the filter, in order
+    QVector<int> m_rows;
+    QScopedPointer<CertificateSearchIndex> m_index;
+    // Rows of the store being inserted or removed
+    int m_changeFirst;
+    int m_changeLast;
+};
+
+// Reports on the expiry and the cryptographic strength of the certificates in
+// a bundle. The bundle is parsed and checked on the global thread pool, from
+// the X509 data directly.
+//
+// Both reports are lists of maps with the keys primaryName, secondaryName,
+// organizationName, fingerprint, notValidBefore, notValidAfter, validity,
+// keyAlgorithm, keyBits, signatureAlgorithm and weaknesses. Both are sorted
+// by notValidAfter, the soonest first.
+class SYSTEMSETTINGS_EXPORT CertificateAnalyzer : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(QString bundlePath READ bundlePath WRITE setBundlePath NOTIFY bundlePathChanged)
+    Q_PROPERTY(int expiryWarningDays READ expiryWarningDays WRITE setExpiryWarningDays NOTIFY expiryWarningDaysChanged)
+    Q_PROPERTY(bool working READ working NOTIFY workingChanged)
+    Q_PROPERTY(QVariantList expiryTimeline READ expiryTimeline NOTIFY finished)
+    Q_PROPERTY(QVariantList weakCertificates READ weakCertificates NOTIFY finished)
+    Q_ENUMS(Validity)
+    Q_FLAGS(Weaknesses)
+
+public:
+    enum Validity {
+        Valid,
+        ExpiringSoon,
+        Expired,
+        NotYetValid
+    };
+
+    enum Weakness {
+        NoWeakness = 0x0,
+        ShortKey = 0x1,
+        WeakSignatureHash = 0x2
+    };
+    Q_DECLARE_FLAGS(Weaknesses, Weakness)
+
+    explicit CertificateAnalyzer(QObject *parent = 0);
+    ~CertificateAnalyzer();
+
+    QString bundlePath() const;
+    void setBundlePath(const QString &path);
+
+    // Certificates expiring within this many days are ExpiringSoon
+    int expiryWarningDays() const;
+    void setExpiryWarningDays(int days);
+
+    bool working() const;
+
+    // Every certificate in the bundle
+    QVariantList expiryTimeline() const;
+    // Only the certificates with weaknesses
+    QVariantList weakCertificates() const;
+
+    Q_INVOKABLE void analyze();
+
+Q_SIGNALS:
+    void bundlePathChanged();
+    void expiryWarningDaysChanged();
+    void workingChanged();
+    void finished();
+
+private slots:
+    void jobFinished(const QVariantList &expiryTimeline, const QVariantList &weakCertificates);
+
+private:
+    QString m_path;
+    int m_expiryWarningDays;
+    CertificateAnalysisJob *m_job;
+    QVariantList m_expiryTimeline;
+    QVariantList m_weakCertificates;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(CertificateAnalyzer::Weaknesses)
+
 #endif
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef CERTIFICATEMODEL_P_H
+#define CERTIFICATEMODEL_P_H
+
+#include <QAtomicInt>
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QSharedData>
+#include <QSharedPointer>
+#include <QTimer>
+#include <QVector>
+
+#include "certificatemodel.h"
+
+class QThread;
+
+// The X509s of a bundle, for the certificates read from its cache. When the
+// cache knows where the PEM block of a certificate is, only that block is read
+// and parsed. Otherwise the bundle is parsed once, on the first such lookup
+// from any of them, and kept as long as any of them is.
+class CertificateBundleX509s
+{
+public:
+    explicit CertificateBundleX509s(const QString &bundlePath);
+
+    // May be called from any thread. pemLength is 0 when the block is not known
+    QSharedPointer<x509_st> x509(const QByteArray &fingerprint, quint32 pemOffset, quint32 pemLength);
+
+private:
+    QMutex m_mutex;
+    QString m_bundlePath;
+    QHash<QByteArray, QSharedPointer<x509_st> > m_x509s;
+    bool m_parsed;
+};
+
+class CertificatePrivate : public QSharedData
+{
+public:
+    CertificatePrivate()
+        : subjectNameHash(0)
+        , issuerNameHash(0)
+        , pemOffset(0)
+        , pemLength(0)
+    {
+    }
+
+    QString commonName;
+    QString countryName;
+    QString organizationName;
+    QString organizationalUnitName;
+    QString primaryName;
+    QString secondaryName;
+
+    QDateTime notValidBefore;
+    QDateTime notValidAfter;
+
+    QString issuerDisplayName;
+
+    QByteArray fingerprint;
+
+    // Keys for finding the issuer
+    quint32 subjectNameHash;
+    quint32 issuerNameHash;
+    QByteArray subjectKeyIdentifier;
+    QByteArray authorityKeyIdentifier;
+
+    // Details are only needed by the detail view, build them on first use.
+    // Certificates read from the cache look the X509 up from the bundle then,
+    // at the PEM block the cache recorded for them
+    QSharedPointer<CertificateBundleX509s> bundle;
+    quint32 pemOffset;
+    quint32 pemLength;
+    QSharedPointer<x509_st> x509;
+    QMutex detailsMutex;
+    QVariantMap details;
+};
+
+class CertificateWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit CertificateWorker(QObject *parent = 0);
+    virtual ~CertificateWorker();
+
+    // Request ids must increase from one request to the next. Thread safe.
+    void cancel(int request);
+
+public slots:
+    void load(const QString &bundlePath, int request);
+    // Reuses the current certificates that are still in the bundle
+    void reload(const QString &bundlePath, const QList<Certificate> &current, int request);
+    void threadFinished();
+
+signals:
+    void loaded(const QList<Certificate> &certificates, int request);
+    void reloaded(const QList<Certificate> &certificates, int request);
+    void finished(int request);
+
+private:
+    bool isCancelled(int request);
+    void finish(int request);
+
+    QMutex m_cancelMutex;
+    QSet<int> m_cancelledRequests;
+    int m_lastFinished;
+};
+
+// Case folded word prefixes of the names, organization, issuer and
+// fingerprint of each certificate, sorted for binary search
+class CertificateSearchIndex
+{
+public:
+    bool isEmpty() const { return m_tokens.isEmpty(); }
+    void clear() { m_tokens.clear(); }
+    void build(const QList<Certificate> &certificates);
+
+    // Clears matches[row] for the rows that have no word starting with term
+    void narrow(const QString &term, QVector<bool> *matches) const;
+
+    static QStringList tokenize(const QString &text);
+    // Like tokenize, but a fingerprint written as hex pairs between colons or
+    // spaces is kept as one term
+    static QStringList filterTerms(const QString &filter);
+
+private:
+    struct Token
+    {
+        QString text;
+        int row;
+
+        bool operator <(const Token &other) const { return text < other.text; }
+    };
+
+    QVector<Token> m_tokens;
+};
+
+// Certificates by fingerprint, subject key identifier and subject name hash,
+// for following a certificate to its issuers in constant time per step. A
+// certificate added more than once, e.g. from several bundles, is kept until
+// removed as many times.
+class CertificateIssuerIndex
+{
+public:
+    void add(const QList<Certificate> &certificates);
+    void remove(const QList<Certificate> &certificates);
+
+    // The issuer first, ending at a self-issued root if that is known
+    QList<Certificate> chain(const Certificate &certificate) const;
+
+    static bool isSelfIssued(const Certificate &certificate);
+
+private:
+    struct Entry
+    {
+        Certificate certificate;
+        int references;
+    };
+
+    Certificate issuer(const Certificate &certificate) const;
+
+    QHash<QByteArray, Entry> m_certificates;
+    QMultiHash<QByteArray, QByteArray> m_subjectKeyIdentifiers;
+    QMultiHash<quint32, QByteArray> m_subjectNameHashes;
+};
+
+// Parsed bundles, shared by all models in the process. A bundle is loaded
+// when the first model acquires it and dropped when the last one releases it.
+// While acquired the bundle file and its directory are watched, and a
+// changed bundle is applied as removals and insertions of the certificates
+// that differ.
+class CertificateStore : public QObject, public QSharedData
+{
+    Q_OBJECT
+
+public:
+    CertificateStore();
+    ~CertificateStore();
+
+    static CertificateStore *instance();
+
+    void acquire(const QString &bundlePath);
+    void release(const QString &bundlePath);
+
+    // Sorted, and filled in while the bundle is being loaded
+    QList<Certificate> certificates(const QString &bundlePath) const;
+
+    // Follows the certificate to its issuers through all loaded bundles and
+    // the intermediates. The system bundles start loading on the worker
+    // thread on first use and are kept, along with the store, until the
+    // application quits. Until they are loaded the chain may stop early.
+    QList<Certificate> issuerChain(const Certificate &certificate,
+                                   const QList<Certificate> &intermediates = QList<Certificate>());
+    // Finishes loading the system bundles on the calling thread, for callers
+    // that can't wait for issuersChanged()
+    void loadPinned();
+
+signals:
+    void certificatesAboutToBeInserted(const QString &bundlePath, int first, int last);
+    void certificatesInserted(const QString &bundlePath);
+    void certificatesAboutToBeRemoved(const QString &bundlePath, int first, int last);
+    void certificatesRemoved(const QString &bundlePath);
+    // A bundle has been loaded or reloaded, chains may have changed
+    void issuersChanged();
+
+private slots:
+    void certificatesLoaded(const QList<Certificate> &certificates, int request);
+    void certificatesReloaded(const QList<Certificate> &certificates, int request);
+    void loadFinished(int request);
+    void bundleChanged(const QString &bundlePath);
+    void directoryChanged(const QString &directory);
+    void reloadChanged();
+
+private:
+    struct Bundle
+    {
+        Bundle() : users(0), request(0), pinned(false) {}
+
+        QList<Certificate> certificates;
+        int users;
+        int request;
+        bool pinned;
+    };
+
+    // The bundle file and its directory, so that a bundle is followed also
+    // when it is removed and created again
+    void watch(const QString &bundlePath);
+    void unwatch(const QString &bundlePath);
+    void load(const QString &bundlePath, Bundle *bundle);
+    void pin();
+    static void unpin();
+    Bundle *requestBundle(int request, QString *bundlePath);
+    // Removes and inserts the certificates that differ from the bundle
+    void update(const QString &bundlePath, Bundle *bundle, const QList<Certificate> &certificates);
+    void insert(const QString &bundlePath, QList<Certificate> *list, const QList<Certificate> &certificates);
+
+    static CertificateStore *sharedInstance;
+    static QExplicitlySharedDataPointer<CertificateStore> pinnedInstance;
+
+    QFileSystemWatcher m_watcher;
+    QTimer m_reloadTimer;
+    QSet<QString> m_changedBundles;
+    QThread *m_thread;
+    CertificateWorker *m_worker;
+    QHash<QString, Bundle> m_bundles;
+    QHash<int, QString> m_requests;
+    int m_lastRequest;
+    CertificateIssuerIndex m_issuers;
+};
+
+// One analysis of a bundle. The bundle is parsed by one pool task, which then
+// splits the certificates into chunks analysed by further tasks. The task
+// finishing the last chunk reports, and the job deletes itself after that.
+class CertificateAnalysisJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    CertificateAnalysisJob(const QString &bundlePath, const QDateTime &now, int expiryWarningDays);
+
+    void start();
+
+    // Run on the pool
+    void parse();
+    void analyze(int first, int last);
+
+signals:
+    void finished(const QVariantList &expiryTimeline, const QVariantList &weakCertificates);
+
+private:
+    struct Entry
+    {
+        QDateTime notValidAfter;
+        QVariantMap report;
+        bool weak;
+    };
+
+    void complete();
+
+    QString m_bundlePath;
+    QDateTime m_now;
+    QDateTime m_warningLimit;
+    QVector<QSharedPointer<x509_st> > m_certificates;
+
+    QMutex m_mutex;
+    QList<Entry> m_entries;
+    QAtomicInt m_pendingChunks;
+};
+
+#endif /* CERTIFICATEMODEL_P_H */
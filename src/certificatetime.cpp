@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "certificatetime_p.h"
+
+QDateTime CertificateTime::decode(const char *data, int length, bool generalized)
+{
+    const char *p = data;
+    const char *end = data + length;
+
+    int year = 0;
+    int month = 0;
+    int day = 0;
+    int hour = 0;
+    if (!readDigits(&p, end, generalized ? 4 : 2, &year) || !readDigits(&p, end, 2, &month)
+            || !readDigits(&p, end, 2, &day) || !readDigits(&p, end, 2, &hour))
+        return QDateTime();
+    if (!generalized)
+        year += (year < 50 ? 2000 : 1900);
+
+    // Only GeneralizedTime can leave the minutes out, both the seconds
+    int minute = 0;
+    int second = 0;
+    int ms = 0;
+    if (readDigits(&p, end, 2, &minute)) {
+        if (readDigits(&p, end, 2, &second) && generalized && p < end && *p == '.') {
+            // Milliseconds, any further digits are dropped
+            if (++p == end || *p < '0' || *p > '9')
+                return QDateTime();
+            for (int scale = 100; p < end && *p >= '0' && *p <= '9'; ++p, scale /= 10)
+                ms += (*p - '0') * scale;
+        }
+    } else if (!generalized) {
+        return QDateTime();
+    }
+
+    int offset = 0;
+    if (p < end && *p == 'Z') {
+        ++p;
+    } else if (p < end && (*p == '+' || *p == '-')) {
+        const bool negative = *p++ == '-';
+        int offsetHours = 0;
+        int offsetMinutes = 0;
+        if (!readDigits(&p, end, 2, &offsetHours) || !readDigits(&p, end, 2, &offsetMinutes)
+                || offsetHours > 23 || offsetMinutes > 59)
+            return QDateTime();
+        offset = offsetHours * 60*60 + offsetMinutes * 60;
+        if (negative)
+            offset = -offset;
+    }
+
+    if (p != end)
+        return QDateTime();
+
+    const QDate date(year, month, day);
+    const QTime time(hour, minute, second, ms);
+    if (!date.isValid() || !time.isValid())
+        return QDateTime();
+
+    return QDateTime(date, time, Qt::OffsetFromUTC, offset);
+}
+
+bool CertificateTime::readDigits(const char **p, const char *end, int count, int *value)
+{
+    if (end - *p < count)
+        return false;
+
+    int rv = 0;
+    for (int i = 0; i < count; ++i) {
+        const char c = (*p)[i];
+        if (c < '0' || c > '9')
+            return false;
+        rv = rv * 10 + (c - '0');
+    }
+
+    *p += count;
+    *value = rv;
+    return true;
+}
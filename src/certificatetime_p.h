@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef CERTIFICATETIME_P_H
+#define CERTIFICATETIME_P_H
+
+#include <QDateTime>
+
+// Decodes the validity times of X.509 certificates, as of RFC 5280 section
+// 4.1.2.5. This is done for every certificate in a bundle, so the fixed
+// formats are read in place:
+// UTCTime "YYMMDDhhmm[ss](Z|(+|-)hhmm)"
+// GeneralizedTime "YYYYMMDDhh[mm[ss[.fff]]](Z|(+|-)hhmm)"
+//
+// Two digit years from 50 on are in the 1900s, those before in the 2000s. A
+// time without a zone is taken as UTC, and fractions of a second are
+// truncated to milliseconds. Anything else gives an invalid QDateTime.
+class CertificateTime
+{
+public:
+    static QDateTime decode(const char *data, int length, bool generalized);
+
+private:
+    static bool readDigits(const char **p, const char *end, int count, int *value);
+};
+
+#endif /* CERTIFICATETIME_P_H */
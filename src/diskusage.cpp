@@ -37,11 +37,43 @@
 #include <QDebug>
 #include <QJSEngine>
 #include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QPointer>
+#include <QSet>
+#include <QSettings>
+#include <QSharedPointer>
+#include <QVector>
+
+#include <algorithm>
+
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+namespace {
+
+// How long measured sizes are reused by later requests, in milliseconds
+const qint64 CacheTimeout = 30 * 1000;
+
+QVariantMap toVariantMap(const QHash<QString, QString> &hash)
+{
+    QVariantMap map;
+    for (QHash<QString, QString>::const_iterator it = hash.cbegin(), end = hash.cend(); it != end; ++it) {
+        map.insert(it.key(), it.value());
+    }
+    return map;
+}
+
+}
 
 
 DiskUsageWorker::DiskUsageWorker(QObject *parent)
     : QObject(parent)
     , m_quit(false)
+    , m_request(0)
+    , m_requestCancelled(new std::atomic<bool>(false))
 {
 }
 
@@ -49,94 +81,866 @@ DiskUsageWorker::~DiskUsageWorker()
 {
 }
 
-void DiskUsageWorker::submit(QStringList paths, QJSValue *callback)
+void DiskUsageWorker::cancel(int request)
 {
-    emit finished(calculate(paths), callback);
+    QMutexLocker locker(&m_cancelMutex);
+    QHash<int, QSharedPointer<std::atomic<bool> > >::const_iterator it = m_activeRequests.constFind(request);
+    if (it != m_activeRequests.constEnd()) {
+        it.value()->store(true);
+    } else if (request > m_request) {
+        m_cancelledRequests.insert(request);
+    }
+    // Other older requests are done already
 }
 
-QVariantMap DiskUsageWorker::calculate(QStringList paths)
+bool DiskUsageWorker::isCancelled() const
+{
+    return m_quit.load() || m_requestCancelled->load();
+}
+
+void DiskUsageWorker::begin(int request)
+{
+    QMutexLocker locker(&m_cancelMutex);
+    m_request = request;
+    m_requestCancelled = QSharedPointer<std::atomic<bool> >(
+                new std::atomic<bool>(m_cancelledRequests.remove(request)));
+    m_activeRequests.insert(request, m_requestCancelled);
+
+    // Requests arrive in order, none of the older ones will come any more
+    for (QSet<int>::iterator it = m_cancelledRequests.begin(); it != m_cancelledRequests.end(); ) {
+        if (*it < request) {
+            it = m_cancelledRequests.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void DiskUsageWorker::end(int request)
+{
+    QMutexLocker locker(&m_cancelMutex);
+    m_activeRequests.remove(request);
+}
+
+void DiskUsageWorker::submit(QStringList paths, bool streaming, DiskUsage::Accounting accounting, int request)
+{
+    begin(request);
+
+    if (isCancelled()) {
+        end(request);
+        emit finished(QVariantMap(), QVariantMap(), request);
+        return;
+    }
+
+    // Other requests may start while apkd is still to answer this one
+    measure(paths, streaming, accounting, [this, request](const QVariantMap &usage, const QHash<QString, QString> &expandedPaths) {
+        end(request);
+        emit finished(usage, toVariantMap(expandedPaths), request);
+    });
+}
+
+void DiskUsageWorker::list(QString path, int maximumCount, DiskUsage::Accounting accounting, int request)
+{
+    begin(request);
+
+    QVariantList children;
+    if (!isCancelled()) {
+        children = listChildren(path, maximumCount, accounting);
+    }
+
+    end(request);
+    emit listed(children, request);
+}
+
+QVariantMap DiskUsageWorker::calculate(QStringList paths, DiskUsage::Accounting accounting)
 {
-    QVariantMap usage;
     // expanded Path places the object in the tree so parents can have it subtracted from its total
-    QMap<QString, QString> expandedPaths; // input path -> expanded path
-    QMap<QString, QString> originalPaths; // expanded path -> input path
+    QHash<QString, QString> expandedPaths; // input path -> expanded path
+    QVariantMap usage;
+    bool done = false;
+    QEventLoop *loop = 0;
+
+    measure(paths, false, accounting, [&](const QVariantMap &measuredUsage, const QHash<QString, QString> &measuredExpandedPaths) {
+        usage = measuredUsage;
+        expandedPaths = measuredExpandedPaths;
+        done = true;
+        if (loop) {
+            loop->quit();
+        }
+    });
+
+    // Waiting for apkd
+    if (!done) {
+        QEventLoop eventLoop;
+        loop = &eventLoop;
+        eventLoop.exec();
+    }
+
+    subtractNestedUsage(&usage, expandedPaths);
+
+    return usage;
+}
+
+// What measure() knows so far, until both the walk is done and apkd answered.
+// The request it belongs to stays cancellable while apkd is waited for.
+struct DiskUsageWorker::PendingUsage
+{
+    PendingUsage() : apkdUsage(0), accounting(DiskUsage::ApparentSize), measured(false), answered(false) {}
+
+    QVariantMap usage;
+    QHash<QString, QString> expandedPaths;
+    QStringList apkdPackages;
+    QStringList apkdPaths;
+    QStringList appsPaths;
+    quint64 apkdUsage;
+    DiskUsage::Accounting accounting;
+    QSharedPointer<std::atomic<bool> > cancelled;
+    UsageFunction done;
+    bool measured;
+    bool answered;
+};
+
+void DiskUsageWorker::measure(const QStringList &paths, bool streaming, DiskUsage::Accounting accounting,
+                              const UsageFunction &done)
+{
+    QSharedPointer<PendingUsage> pending(new PendingUsage);
+    pending->accounting = accounting;
+    pending->cancelled = m_requestCancelled;
+    pending->done = done;
+    QVariantMap &usage = pending->usage;
+    QHash<QString, QString> *expandedPaths = &pending->expandedPaths;
 
     // Older adaptations (e.g. Jolla 1) don't have /home/.android/. Android home is in the root.
     QString androidHome = QString("/home/.android");
     bool androidHomeExists = QDir(androidHome).exists();
 
+    // Plain directories and RPM globs are measured together once every
+    // path is known
+    QStringList directories;
+    QStringList directoryPaths;
+    QStringList rpmGlobs;
+    QStringList rpmPaths;
+    QStringList largestPaths;
+    int largestEntryCount = 0;
+    QStringList &appsPaths = pending->appsPaths;
+    QStringList &apkdPackages = pending->apkdPackages;
+    QStringList &apkdPaths = pending->apkdPaths;
+
     foreach (const QString &path, paths) {
         QString expandedPath;
+        // Pseudo-path for finding the largest files and directories below
+        // the other directories of the request, e.g. ":largest:20". The value
+        // is a list of maps with path, size and isDirectory, largest first.
+        if (path.startsWith(":largest:")) {
+            largestPaths << path;
+            largestEntryCount = qMax(largestEntryCount, path.mid(9).toInt());
+            continue;
+        } else if (path.startsWith(":apps:")) {
+            // Pseudo-path for the storage used by each application whose
+            // package matches the glob, e.g. ":apps:harbour-*"
+            appsPaths << path;
+            continue;
+        }
+
         // Pseudo-path for querying RPM database for file sizes
         // ----------------------------------------------------
         // Example path with package name: ":rpm:python3-base"
         // Example path with glob: ":rpm:harbour-*" (will sum up all matching package sizes)
         if (path.startsWith(":rpm:")) {
-            QString glob = path.mid(5);
-            usage[path] = calculateRpmSize(glob);
+            rpmGlobs << path.mid(5);
+            rpmPaths << path;
             expandedPath = "/usr/" + path;
         } else if (path.startsWith(":apkd:")) {
             // Pseudo-path for querying Android apps' data usage
+            // -------------------------------------------------
+            // Example path for all apps: ":apkd:"
+            // Example path for one app: ":apkd:com.example.app" (nested in ":apkd:")
             QString rest = path.mid(6);
-            usage[path] = calculateApkdSize(rest);
+            apkdPackages << rest;
+            apkdPaths << path;
             expandedPath = (androidHomeExists ? androidHome : "") + "/data/data";
+            if (!rest.isEmpty()) {
+                expandedPath += '/' + rest;
+            }
         } else {
-            quint64 size = calculateSize(path, &expandedPath, androidHomeExists);
-            if (expandedPath.startsWith(androidHome) && !androidHomeExists) {
-                expandedPath = expandedPath.mid(androidHome.length());
+            expandedPath = expandPath(path, androidHomeExists);
+            directories << expandedPath;
+            directoryPaths << path;
+        }
+
+        expandedPaths->insert(path, expandedPath);
+        if (isCancelled()) {
+            break;
+        }
+    }
+
+    const CancelFunction cancelled = [this]() {
+        return isCancelled();
+    };
+
+    // Answered by apkd while the rest is measured. The applications include
+    // the data of all Android apps.
+    if ((!apkdPackages.contains(QString()) && appsPaths.isEmpty()) || cancelled()) {
+        pending->answered = true;
+    } else {
+        queryApkdUsage([this, pending](quint64 size) {
+            pending->apkdUsage = size;
+            pending->answered = true;
+            finishMeasuring(pending);
+        });
+    }
+
+    if (!rpmGlobs.isEmpty() && !cancelled()) {
+        const QList<quint64> sizes = calculateRpmSizes(rpmGlobs);
+        for (int i = 0; i < rpmPaths.count(); ++i) {
+            usage[rpmPaths.at(i)] = sizes.value(i);
+        }
+    }
+
+    // While streaming, report the sizes counted so far for the directories
+    // still being measured, along with everything else that is known
+    ProgressFunction progressFunction;
+    if (streaming) {
+        const QVariantMap expanded(toVariantMap(*expandedPaths));
+        progressFunction = [&](const QList<quint64> &sizes) {
+            QVariantMap partialUsage(usage);
+            for (int i = 0; i < directoryPaths.count(); ++i) {
+                partialUsage[directoryPaths.at(i)] = sizes.value(i);
             }
-            usage[path] = size;
+            emit progress(partialUsage, expanded, m_request);
+        };
+    }
+
+    if (!cancelled()) {
+        QVariantList largestEntries;
+        const QList<quint64> sizes = calculateSizes(directories, accounting, progressFunction, cancelled,
+                                                    largestEntryCount, &largestEntries);
+        for (int i = 0; i < directoryPaths.count(); ++i) {
+            usage[directoryPaths.at(i)] = sizes.value(i);
         }
+        foreach (const QString &path, largestPaths) {
+            usage[path] = largestEntries.mid(0, path.mid(9).toInt());
+        }
+    }
 
-        expandedPaths[path] = expandedPath;
-        originalPaths[expandedPath] = path;
-        if (m_quit) {
+    // After the directories, which may have put the home directory into the
+    // index already
+    foreach (const QString &path, appsPaths) {
+        if (cancelled()) {
             break;
         }
+        usage[path] = attributeApplications(path.mid(6), accounting);
+    }
+
+    pending->measured = true;
+    finishMeasuring(pending);
+}
+
+void DiskUsageWorker::finishMeasuring(const QSharedPointer<PendingUsage> &pending)
+{
+    if (!pending->measured || !pending->answered) {
+        return;
+    }
+
+    // apkd only tells the total, single packages have their data
+    // directories walked, as far as they can be read
+    QStringList directories;
+    QStringList directoryPaths;
+    for (int i = 0; i < pending->apkdPaths.count(); ++i) {
+        const QString &path = pending->apkdPaths.at(i);
+        if (pending->apkdPackages.at(i).isEmpty()) {
+            pending->usage[path] = pending->apkdUsage;
+        } else {
+            directories << pending->expandedPaths.value(path);
+            directoryPaths << path;
+        }
+    }
+
+    // Another request may have begun by now, so this checks the flag of its
+    // own request
+    const CancelFunction cancelled = [this, pending]() {
+        return m_quit.load() || pending->cancelled->load();
+    };
+    if (!directories.isEmpty() && !cancelled()) {
+        const QList<quint64> sizes = calculateSizes(directories, pending->accounting, ProgressFunction(), cancelled);
+        for (int i = 0; i < directoryPaths.count(); ++i) {
+            pending->usage[directoryPaths.at(i)] = sizes.value(i);
+        }
+    }
+
+    foreach (const QString &path, pending->appsPaths) {
+        if (pending->usage.contains(path)) {
+            QVariantMap applications = pending->usage.value(path).toMap();
+            QVariantMap android;
+            android.insert("data", pending->apkdUsage);
+            applications.insert(":android:", android);
+            pending->usage[path] = applications;
+        }
     }
 
-    // Sort keys in reverse order (so child directories come before their
-    // parents, and the calculation is done correctly, no child directory
-    // subtracted once too often), for example:
-    //  1. a0 = size(/home/<user>/foo/)
-    //  2. b0 = size(/home/<user>/)
-    //  3. c0 = size(/)
-    //
-    // This will calculate the following changes in the nested for loop below:
-    //  1. b1 = b0 - a0
-    //  2. c1 = c0 - a0
-    //  3. c2 = c1 - b1
-    //
-    // Combined and simplified, this will give us the output values:
-    //  1. a' = a0
-    //  2. b' = b1 = b0 - a0
-    //  3. c' = c2 = c1 - b1 = (c0 - a0) - (b0 - a0) = c0 - a0 - b0 + a0 = c0 - b0
-    //
-    // Or with paths:
-    //  1. output(/home/<user>/foo/) = size(/home/<user>/foo/)
-    //  2. output(/home/<user>/)     = size(/home/<user>/)     - size(/home/<user>/foo/)
-    //  3. output(/)               = size(/)               - size(/home/<user>/)
-    QStringList keys;
-    foreach (const QString &key, usage.uniqueKeys()) {
-        keys << expandedPaths.value(key, key);
-    }
-    qStableSort(keys.begin(), keys.end(), qGreater<QString>());
-    for (int i=0; i<keys.length(); i++) {
-        for (int j=i+1; j<keys.length(); j++) {
-            QString subpath = keys[i];
-            QString path = keys[j];
-
-            if ((subpath.length() > path.length() && subpath.indexOf(path) == 0) || (path == "/")) {
-                qlonglong subbytes = usage[originalPaths.value(subpath, subpath)].toLongLong();
-                qlonglong bytes = usage[originalPaths.value(path, path)].toLongLong();
-
-                bytes -= subbytes;
-                usage[originalPaths.value(path, path)] = bytes;
+    pending->done(pending->usage, pending->expandedPaths);
+}
+
+// Makes the size of every path exclusive of the paths nested in it, for
+// example:
+//  1. a0 = size(/home/<user>/foo/)
+//  2. b0 = size(/home/<user>/)
+//  3. c0 = size(/)
+//
+// gives the output values:
+//  1. a' = a0
+//  2. b' = b0 - a0
+//  3. c' = c0 - b0
+//
+// Nesting is decided on the expanded paths with a plain string prefix match,
+// so ":rpm:harbour-*" is nested in ":rpm:", and "/" contains every other path.
+// In sorted order the paths nested in a path directly follow it, so a single
+// pass with a stack of the enclosing paths finds the closest enclosing path of
+// each, and only that one has the size subtracted.
+void DiskUsageWorker::subtractNestedUsage(QVariantMap *usage, const QHash<QString, QString> &expandedPaths)
+{
+    struct Entry
+    {
+        QString expandedPath;
+        QString path;
+        qlonglong bytes;
+        qlonglong nestedBytes;
+    };
+
+    QVector<Entry> entries;
+    entries.reserve(usage->count());
+    for (QVariantMap::const_iterator it = usage->cbegin(), end = usage->cend(); it != end; ++it) {
+        // Not a size, e.g. the entries of ":largest:" or ":apps:"
+        if (it.value().type() == QVariant::List || it.value().type() == QVariant::Map) {
+            continue;
+        }
+        Entry entry = { expandedPaths.value(it.key(), it.key()), it.key(), it.value().toLongLong(), 0 };
+        entries.append(entry);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &lhs, const Entry &rhs) {
+        return lhs.expandedPath < rhs.expandedPath;
+    });
+
+    QVector<int> enclosing;
+    for (int i = 0; i < entries.count(); ++i) {
+        const QString &path = entries.at(i).expandedPath;
+        while (!enclosing.isEmpty()) {
+            const QString &parent = entries.at(enclosing.last()).expandedPath;
+            if (parent == "/" || (path.length() > parent.length() && path.startsWith(parent))) {
+                break;
             }
+            enclosing.removeLast();
+        }
+
+        if (!enclosing.isEmpty()) {
+            entries[enclosing.last()].nestedBytes += entries.at(i).bytes;
         }
+        enclosing.append(i);
     }
 
-    return usage;
+    foreach (const Entry &entry, entries) {
+        if (entry.nestedBytes != 0) {
+            (*usage)[entry.path] = entry.bytes - entry.nestedBytes;
+        }
+    }
+}
+
+// Breaks the storage used by applications down per package: the installed
+// size from the RPM database, and the data, cache and config directories in
+// the home directory. Those are named after the package, or after the
+// organization and application names of its Sailjail desktop entry. Each
+// directory is counted for one package only.
+//
+// The home directory is walked once, and the sizes of the application
+// directories are taken from that walk. ":other:" holds what is left over in the home directory and in the
+// installed packages. measure() adds the Android app data as ":android:" once
+// apkd has answered.
+QVariantMap DiskUsageWorker::attributeApplications(const QString &glob, DiskUsage::Accounting accounting)
+{
+    static const char * const categories[] = { "data", "cache", "config" };
+    static const char * const bases[] = { "/.local/share/", "/.cache/", "/.config/" };
+    static const int categoryCount = 3;
+
+    struct Application {
+        QString package;
+        quint64 installed;
+        QList<int> directories[categoryCount];
+    };
+
+    const QString home = QDir::homePath();
+    const QByteArray pattern(glob.toUtf8());
+    const QVariantMap packages = installedPackages();
+
+    QVector<Application> applications;
+    QStringList directories;
+    QSet<QString> attributed;
+    quint64 installedTotal = 0;
+    quint64 installedAttributed = 0;
+
+    for (QVariantMap::const_iterator it = packages.cbegin(); it != packages.cend(); ++it) {
+        const quint64 installed = it.value().toULongLong();
+        installedTotal += installed;
+        if (!pattern.isEmpty() && fnmatch(pattern.constData(), it.key().toUtf8().constData(), 0) != 0) {
+            continue;
+        }
+        installedAttributed += installed;
+
+        Application application;
+        application.package = it.key();
+        application.installed = installed;
+
+        QStringList names(it.key());
+        QSettings desktop(QString("/usr/share/applications/%1.desktop").arg(it.key()), QSettings::IniFormat);
+        const QString organization = desktop.value("X-Sailjail/OrganizationName").toString();
+        const QString name = desktop.value("X-Sailjail/ApplicationName").toString();
+        if (!organization.isEmpty() && !name.isEmpty()) {
+            names << organization + '/' + name;
+        }
+
+        for (int category = 0; category < categoryCount; ++category) {
+            foreach (const QString &name, names) {
+                const QString directory = home + bases[category] + name;
+                if (!attributed.contains(directory)) {
+                    attributed.insert(directory);
+                    application.directories[category].append(directories.count());
+                    directories.append(directory);
+                }
+            }
+        }
+
+        applications.append(application);
+    }
+
+    const CancelFunction cancelled = [this]() {
+        return isCancelled();
+    };
+
+    QList<quint64> sizes;
+    const quint64 homeSize = calculateSizes(QStringList() << home, accounting, ProgressFunction(), cancelled,
+                                            0, 0, directories, &sizes).value(0);
+
+    QVariantMap result;
+    quint64 homeAttributed = 0;
+    foreach (const Application &application, applications) {
+        QVariantMap entry;
+        quint64 total = application.installed;
+        entry.insert("installed", application.installed);
+        for (int category = 0; category < categoryCount; ++category) {
+            quint64 size = 0;
+            foreach (int directory, application.directories[category]) {
+                size += sizes.value(directory);
+            }
+            entry.insert(categories[category], size);
+            total += size;
+            homeAttributed += size;
+        }
+        entry.insert("total", total);
+        result.insert(application.package, entry);
+    }
+
+    QVariantMap other;
+    other.insert("home", homeSize > homeAttributed ? homeSize - homeAttributed : 0);
+    other.insert("installed", installedTotal - installedAttributed);
+    result.insert(":other:", other);
+
+    return result;
+}
+
+QVariantList DiskUsageWorker::listChildren(const QString &path, int maximumCount, DiskUsage::Accounting accounting)
+{
+    struct Child {
+        QString name;
+        quint64 size;
+        bool directory;
+    };
+
+    QVariantList result;
+
+    struct stat st;
+    if (::lstat(QFile::encodeName(path).constData(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return result;
+    }
+    const dev_t device = st.st_dev;
+
+    QVector<Child> children;
+    QStringList directories;
+    QList<int> directoryIndexes;
+
+    QDirIterator it(path, QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System);
+    while (it.hasNext() && !isCancelled()) {
+        it.next();
+        // Like the walker, leave other filesystems out
+        if (::lstat(QFile::encodeName(it.filePath()).constData(), &st) < 0 || st.st_dev != device) {
+            continue;
+        }
+
+        const quint64 size = accounting == DiskUsage::AllocatedSize ? quint64(st.st_blocks) * 512 : quint64(st.st_size);
+        Child child = { it.fileName(), size, S_ISDIR(st.st_mode) != 0 };
+        if (child.directory) {
+            directoryIndexes.append(children.count());
+            directories.append(it.filePath());
+        }
+        children.append(child);
+    }
+
+    // Directories measured earlier come from the index without a walk
+    if (!directories.isEmpty() && !isCancelled()) {
+        const QList<quint64> sizes = calculateSizes(directories, accounting, ProgressFunction(), [this]() {
+            return isCancelled();
+        });
+        for (int i = 0; i < directoryIndexes.count(); ++i) {
+            children[directoryIndexes.at(i)].size = sizes.value(i);
+        }
+    }
+
+    if (isCancelled()) {
+        return result;
+    }
+
+    const auto larger = [](const Child &a, const Child &b) { return a.size > b.size; };
+    if (maximumCount > 0 && maximumCount < children.count()) {
+        std::partial_sort(children.begin(), children.begin() + maximumCount, children.end(), larger);
+        children.resize(maximumCount);
+    } else {
+        std::sort(children.begin(), children.end(), larger);
+    }
+
+    const QString prefix = path.endsWith('/') ? path : path + '/';
+    foreach (const Child &child, children) {
+        QVariantMap entry;
+        entry.insert("name", child.name);
+        entry.insert("path", prefix + child.name);
+        entry.insert("size", child.size);
+        entry.insert("isDirectory", child.directory);
+        result.append(entry);
+    }
+
+    return result;
+}
+
+QString DiskUsageWorker::expandPath(QString path, bool androidHomeExists) const
+{
+    // In lieu of wordexp(3) support in Qt, fake it
+    if (path.startsWith("~/")) {
+        path = QDir::homePath() + '/' + path.mid(2);
+    }
+
+    QString androidHome = QString("/home/.android");
+    if (!androidHomeExists && path.startsWith(androidHome)) {
+        path = path.mid(androidHome.length());
+    }
+
+    return path;
+}
+
+DiskUsageService *DiskUsageService::instance()
+{
+    static QPointer<DiskUsageService> service;
+    if (!service) {
+        service = new DiskUsageService(QCoreApplication::instance());
+    }
+    return service;
+}
+
+DiskUsageService::DiskUsageService(QObject *parent)
+    : QObject(parent)
+    , m_thread(new QThread())
+    , m_worker(new DiskUsageWorker())
+    , m_scheduler(createScheduler(this))
+    , m_active(false)
+    , m_lastRequest(0)
+    , m_lastBatch(0)
+{
+    qRegisterMetaType<DiskUsage::Accounting>("DiskUsage::Accounting");
+
+    m_clock.start();
+    m_worker->moveToThread(m_thread);
+
+    connect(this, SIGNAL(submit(QStringList, bool, DiskUsage::Accounting, int)),
+            m_worker, SLOT(submit(QStringList, bool, DiskUsage::Accounting, int)));
+
+    connect(m_worker, SIGNAL(progress(QVariantMap, QVariantMap, int)),
+            this, SLOT(batchProgress(QVariantMap, QVariantMap, int)));
+
+    connect(m_worker, SIGNAL(finished(QVariantMap, QVariantMap, int)),
+            this, SLOT(batchFinished(QVariantMap, QVariantMap, int)));
+
+    connect(this, SIGNAL(submitList(QString, int, DiskUsage::Accounting, int)),
+            m_worker, SLOT(list(QString, int, DiskUsage::Accounting, int)));
+
+    connect(m_worker, SIGNAL(listed(QVariantList, int)),
+            this, SLOT(batchListed(QVariantList, int)));
+
+    if (m_scheduler) {
+        connect(this, SIGNAL(activeChanged(bool)),
+                m_scheduler, SLOT(setActive(bool)));
+        connect(m_scheduler, SIGNAL(refreshRequested()),
+                this, SLOT(refresh()));
+    }
+
+    // Scanning is background work, never slow down the foreground for it
+    m_thread->start(QThread::IdlePriority);
+}
+
+DiskUsageService::~DiskUsageService()
+{
+    // Make sure the worker quits as soon as possible
+    m_worker->scheduleQuit();
+    m_thread->quit();
+    m_thread->wait();
+
+    delete m_worker;
+    delete m_thread;
+}
+
+int DiskUsageService::request(const QStringList &paths, bool streaming, DiskUsage::Accounting accounting)
+{
+    const qint64 now = m_clock.elapsed();
+    for (QHash<PathKey, Measurement>::iterator it = m_cache.begin(); it != m_cache.end(); ) {
+        if (now - it->time > CacheTimeout) {
+            it = m_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    const int id = ++m_lastRequest;
+    Request &request = m_requests[id];
+    request.paths = paths;
+    request.streaming = streaming;
+
+    // The largest entries must come from walking every path of the request
+    bool standalone = false;
+    foreach (const QString &path, paths) {
+        if (path.startsWith(":largest:")) {
+            standalone = true;
+        }
+    }
+
+    // Take what is cached, join the batches already measuring the other
+    // paths, and measure whatever remains in a batch of its own
+    QStringList missing;
+    foreach (const QString &path, paths) {
+        const PathKey key(accounting, path);
+        QHash<PathKey, Measurement>::const_iterator cached = m_cache.constFind(key);
+        if (standalone) {
+            if (!missing.contains(path)) {
+                missing.append(path);
+            }
+        } else if (cached != m_cache.constEnd()) {
+            request.usage.insert(path, cached->size);
+            request.expandedPaths.insert(path, cached->expandedPath);
+        } else if (m_measuring.contains(key)) {
+            const int batch = m_measuring.value(key);
+            m_batches[batch].requests.insert(id);
+            request.batches.insert(batch);
+        } else if (!missing.contains(path)) {
+            missing.append(path);
+        }
+    }
+
+    if (!missing.isEmpty()) {
+        const int batch = ++m_lastBatch;
+        Batch &b = m_batches[batch];
+        b.paths = missing;
+        b.accounting = accounting;
+        b.requests.insert(id);
+        foreach (const QString &path, missing) {
+            m_measuring.insert(PathKey(accounting, path), batch);
+        }
+        request.batches.insert(batch);
+
+        emit submit(missing, streaming, accounting, batch);
+        updateActive();
+    }
+
+    if (request.batches.isEmpty()) {
+        // Everything was cached, but still answer asynchronously
+        QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection, Q_ARG(int, id));
+    }
+
+    return id;
+}
+
+int DiskUsageService::requestChildren(const QString &path, int maximumCount, DiskUsage::Accounting accounting)
+{
+    const int id = ++m_lastRequest;
+    const int batch = ++m_lastBatch;
+    m_listings.insert(batch, id);
+
+    emit submitList(path, maximumCount, accounting, batch);
+    updateActive();
+
+    return id;
+}
+
+void DiskUsageService::cancel(int id)
+{
+    for (QHash<int, int>::iterator listing = m_listings.begin(); listing != m_listings.end(); ++listing) {
+        if (listing.value() == id) {
+            m_worker->cancel(listing.key());
+            m_listings.erase(listing);
+            updateActive();
+            return;
+        }
+    }
+
+    QHash<int, Request>::iterator it = m_requests.find(id);
+    if (it == m_requests.end()) {
+        return;
+    }
+
+    // Batches are only stopped once nobody is waiting for them any more
+    foreach (int batch, it->batches) {
+        QHash<int, Batch>::iterator b = m_batches.find(batch);
+        if (b == m_batches.end()) {
+            continue;
+        }
+
+        b->requests.remove(id);
+        if (b->requests.isEmpty()) {
+            m_worker->cancel(batch);
+            foreach (const QString &path, b->paths) {
+                const PathKey key(b->accounting, path);
+                if (m_measuring.value(key) == batch) {
+                    m_measuring.remove(key);
+                }
+            }
+            m_batches.erase(b);
+        }
+    }
+
+    m_requests.erase(it);
+    updateActive();
+}
+
+void DiskUsageService::setRefreshPaths(QObject *owner, const QStringList &paths, DiskUsage::Accounting accounting)
+{
+    if (paths.isEmpty()) {
+        m_refreshPaths.remove(owner);
+    } else {
+        m_refreshPaths.insert(owner, qMakePair(paths, accounting));
+    }
+}
+
+void DiskUsageService::refresh()
+{
+    // Nobody waits for the results, they go to the cache and the index
+    typedef QPair<QStringList, DiskUsage::Accounting> RefreshPaths;
+    foreach (const RefreshPaths &paths, m_refreshPaths) {
+        request(paths.first, false, paths.second);
+    }
+}
+
+void DiskUsageService::updateActive()
+{
+    const bool active = !m_batches.isEmpty() || !m_listings.isEmpty();
+    if (m_active != active) {
+        m_active = active;
+        emit activeChanged(active);
+    }
+}
+
+void DiskUsageService::batchProgress(QVariantMap usage, QVariantMap expandedPaths, int batch)
+{
+    QHash<int, Batch>::iterator b = m_batches.find(batch);
+    if (b == m_batches.end()) {
+        return;
+    }
+
+    b->partialUsage = usage;
+    b->partialExpandedPaths = expandedPaths;
+
+    foreach (int id, b->requests) {
+        QHash<int, Request>::const_iterator it = m_requests.constFind(id);
+        if (it == m_requests.constEnd() || !it->streaming) {
+            continue;
+        }
+
+        QVariantMap partialUsage(it->usage);
+        QHash<QString, QString> partialExpandedPaths(it->expandedPaths);
+        foreach (int pending, it->batches) {
+            const Batch p = m_batches.value(pending);
+            for (QVariantMap::const_iterator u = p.partialUsage.cbegin(); u != p.partialUsage.cend(); ++u) {
+                if (it->paths.contains(u.key())) {
+                    partialUsage.insert(u.key(), u.value());
+                    partialExpandedPaths.insert(u.key(), p.partialExpandedPaths.value(u.key()).toString());
+                }
+            }
+        }
+
+        DiskUsageWorker::subtractNestedUsage(&partialUsage, partialExpandedPaths);
+        emit progress(id, partialUsage);
+    }
+}
+
+void DiskUsageService::batchFinished(QVariantMap usage, QVariantMap expandedPaths, int batch)
+{
+    QHash<int, Batch>::iterator b = m_batches.find(batch);
+    if (b == m_batches.end()) {
+        // Cancelled, the sizes may be partial
+        return;
+    }
+
+    const Batch finished(*b);
+    m_batches.erase(b);
+    updateActive();
+
+    const qint64 now = m_clock.elapsed();
+    foreach (const QString &path, finished.paths) {
+        const PathKey key(finished.accounting, path);
+        if (m_measuring.value(key) == batch) {
+            m_measuring.remove(key);
+        }
+        if (usage.contains(path) && !path.startsWith(":largest:")) {
+            Measurement measurement = { usage.value(path), expandedPaths.value(path).toString(), now };
+            m_cache.insert(key, measurement);
+        }
+    }
+
+    foreach (int id, finished.requests) {
+        QHash<int, Request>::iterator it = m_requests.find(id);
+        if (it == m_requests.end()) {
+            continue;
+        }
+
+        foreach (const QString &path, finished.paths) {
+            if (usage.contains(path)) {
+                it->usage.insert(path, usage.value(path));
+                it->expandedPaths.insert(path, expandedPaths.value(path).toString());
+            }
+        }
+
+        it->batches.remove(batch);
+        if (it->batches.isEmpty()) {
+            deliver(id);
+        }
+    }
+}
+
+void DiskUsageService::batchListed(QVariantList children, int batch)
+{
+    // Unknown when cancelled
+    if (m_listings.contains(batch)) {
+        const int request = m_listings.take(batch);
+        updateActive();
+        emit childrenListed(request, children);
+    }
+}
+
+void DiskUsageService::deliver(int id)
+{
+    QHash<int, Request>::iterator it = m_requests.find(id);
+    if (it == m_requests.end()) {
+        return;
+    }
+
+    QVariantMap usage(it->usage);
+    DiskUsageWorker::subtractNestedUsage(&usage, it->expandedPaths);
+    m_requests.erase(it);
+
+    emit finished(id, usage);
 }
 
 class DiskUsagePrivate
@@ -151,39 +955,29 @@ public:
     ~DiskUsagePrivate();
 
 private:
-    QThread *m_thread;
-    DiskUsageWorker *m_worker;
+    DiskUsageService *m_service;
+    int m_request;
+    QJSValue m_callback;
 };
 
 DiskUsagePrivate::DiskUsagePrivate(DiskUsage *usage)
     : q_ptr(usage)
-    , m_thread(new QThread())
-    , m_worker(new DiskUsageWorker())
+    , m_service(DiskUsageService::instance())
+    , m_request(0)
 {
-    m_worker->moveToThread(m_thread);
-
-    QObject::connect(usage, SIGNAL(submit(QStringList, QJSValue *)),
-                     m_worker, SLOT(submit(QStringList, QJSValue *)));
+    QObject::connect(m_service, SIGNAL(progress(int, QVariantMap)),
+                     usage, SLOT(progress(int, QVariantMap)));
 
-    QObject::connect(m_worker, SIGNAL(finished(QVariantMap, QJSValue *)),
-                     usage, SLOT(finished(QVariantMap, QJSValue *)));
-
-    QObject::connect(m_thread, SIGNAL(finished()),
-                     m_worker, SLOT(deleteLater()));
-
-    QObject::connect(m_thread, SIGNAL(finished()),
-                     m_thread, SLOT(deleteLater()));
-
-    m_thread->start();
+    QObject::connect(m_service, SIGNAL(finished(int, QVariantMap)),
+                     usage, SLOT(finished(int, QVariantMap)));
 }
 
 DiskUsagePrivate::~DiskUsagePrivate()
 {
-    // Make sure the worker quits as soon as possible
-    m_worker->scheduleQuit();
-
-    // Tell thread to shut down as early as possible
-    m_thread->quit();
+    if (m_request) {
+        m_service->cancel(m_request);
+    }
+    m_service->setRefreshPaths(q_ptr, QStringList());
 }
 
 
@@ -191,6 +985,9 @@ DiskUsage::DiskUsage(QObject *parent)
     : QObject(parent)
     , d_ptr(new DiskUsagePrivate(this))
     , m_working(false)
+    , m_streaming(false)
+    , m_refreshWhileCharging(false)
+    , m_accounting(ApparentSize)
 {
     qWarning() << Q_FUNC_INFO << "DiskUsage is deprecated in org.nemomobile.systemsettings package 0.5.22 (Sept 2019), use DiskUsage from Nemo.FileManager instead.";
 }
@@ -201,21 +998,61 @@ DiskUsage::~DiskUsage()
 
 void DiskUsage::calculate(const QStringList &paths, QJSValue callback)
 {
-    QJSValue *cb = 0;
+    Q_D(DiskUsage);
 
-    if (!callback.isNull() && !callback.isUndefined() && callback.isCallable()) {
-        cb = new QJSValue(callback);
+    // A new request replaces whatever is still being calculated
+    if (d->m_request) {
+        d->m_service->cancel(d->m_request);
     }
 
+    d->m_callback = callback;
+    d->m_request = d->m_service->request(paths, m_streaming, m_accounting);
+    m_paths = paths;
+    if (m_refreshWhileCharging) {
+        d->m_service->setRefreshPaths(this, m_paths, m_accounting);
+    }
     setWorking(true);
-    emit submit(paths, cb);
 }
 
-void DiskUsage::finished(QVariantMap usage, QJSValue *callback)
+void DiskUsage::cancel()
 {
-    if (callback) {
-        callback->call(QJSValueList() << callback->engine()->toScriptValue(usage));
-        delete callback;
+    Q_D(DiskUsage);
+
+    if (d->m_request) {
+        d->m_service->cancel(d->m_request);
+        d->m_request = 0;
+    }
+    d->m_callback = QJSValue();
+    setWorking(false);
+}
+
+void DiskUsage::progress(int request, QVariantMap usage)
+{
+    Q_D(DiskUsage);
+
+    if (request != d->m_request) {
+        return;
+    }
+
+    // Batched by the worker, so bindings are updated once per batch
+    m_result = usage;
+    emit resultChanged();
+}
+
+void DiskUsage::finished(int request, QVariantMap usage)
+{
+    Q_D(DiskUsage);
+
+    if (request != d->m_request) {
+        return;
+    }
+
+    QJSValue callback(d->m_callback);
+    d->m_request = 0;
+    d->m_callback = QJSValue();
+
+    if (!callback.isNull() && !callback.isUndefined() && callback.isCallable()) {
+        callback.call(QJSValueList() << callback.engine()->toScriptValue(usage));
     }
 
     // the result has been set, so emit resultChanged() even if result was not valid
@@ -229,3 +1066,45 @@ QVariantMap DiskUsage::result() const
 {
     return m_result;
 }
+
+bool DiskUsage::streaming() const
+{
+    return m_streaming;
+}
+
+void DiskUsage::setStreaming(bool streaming)
+{
+    if (m_streaming != streaming) {
+        m_streaming = streaming;
+        emit streamingChanged();
+    }
+}
+
+bool DiskUsage::refreshWhileCharging() const
+{
+    return m_refreshWhileCharging;
+}
+
+void DiskUsage::setRefreshWhileCharging(bool refresh)
+{
+    Q_D(DiskUsage);
+
+    if (m_refreshWhileCharging != refresh) {
+        m_refreshWhileCharging = refresh;
+        d->m_service->setRefreshPaths(this, refresh ? m_paths : QStringList(), m_accounting);
+        emit refreshWhileChargingChanged();
+    }
+}
+
+DiskUsage::Accounting DiskUsage::accounting() const
+{
+    return m_accounting;
+}
+
+void DiskUsage::setAccounting(Accounting accounting)
+{
+    if (m_accounting != accounting) {
+        m_accounting = accounting;
+        emit accountingChanged();
+    }
+}
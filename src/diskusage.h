@@ -52,25 +52,67 @@ class SYSTEMSETTINGS_EXPORT DiskUsage : public QObject
 
     Q_PROPERTY(QVariantMap result READ result NOTIFY resultChanged)
 
+    // When set, result is updated a few times a second while calculating,
+    // with the sizes measured so far. The callback is only called at the end.
+    Q_PROPERTY(bool streaming READ streaming WRITE setStreaming NOTIFY streamingChanged)
+
+    // When set, the paths last calculated are measured again in the
+    // background while the device is charging and not in use, so that the
+    // next calculation finds them up to date
+    Q_PROPERTY(bool refreshWhileCharging READ refreshWhileCharging WRITE setRefreshWhileCharging NOTIFY refreshWhileChargingChanged)
+
+    // How the sizes of files are counted, ApparentSize unless set. Applies
+    // to the next calculation.
+    Q_PROPERTY(Accounting accounting READ accounting WRITE setAccounting NOTIFY accountingChanged)
+    Q_ENUMS(Accounting)
+
 public:
+    enum Accounting {
+        // The length of the files, like "du -sb"
+        ApparentSize,
+        // The blocks allocated for the files, like "du -s", which is what
+        // deleting them would free
+        AllocatedSize
+    };
+
     explicit DiskUsage(QObject *parent=0);
     virtual ~DiskUsage();
 
     // Calculate the disk usage of the given paths, then call
-    // callback with a QVariantMap (mapping paths to usages in bytes)
+    // callback with a QVariantMap (mapping paths to usages in bytes).
+    // A calculation still running is cancelled, and its callback not called.
+    // Adding ":largest:N" to paths also gives the N largest files and
+    // directories below the other paths, as a list of maps with path, size
+    // and isDirectory.
+    // ":apps:GLOB" gives a map from each package matching the glob to a map
+    // of its installed, data, cache, config and total sizes, along with
+    // ":android:" and the unattributed ":other:" storage.
     Q_INVOKABLE void calculate(const QStringList &paths, QJSValue callback);
 
+    // Stop the running calculation, leaving result as it is
+    Q_INVOKABLE void cancel();
+
     QVariantMap result() const;
 
+    bool streaming() const;
+    void setStreaming(bool streaming);
+
+    bool refreshWhileCharging() const;
+    void setRefreshWhileCharging(bool refresh);
+
+    Accounting accounting() const;
+    void setAccounting(Accounting accounting);
+
 signals:
     void workingChanged();
     void resultChanged();
-
-signals:
-    void submit(QStringList paths, QJSValue *callback);
+    void streamingChanged();
+    void refreshWhileChargingChanged();
+    void accountingChanged();
 
 private slots:
-    void finished(QVariantMap usage, QJSValue *callback);
+    void progress(int request, QVariantMap usage);
+    void finished(int request, QVariantMap usage);
 
 private:
     bool working() const { return m_working; }
@@ -86,6 +128,12 @@ private:
     QScopedPointer<DiskUsagePrivate> const d_ptr;
     QVariantMap m_result;
     bool m_working;
+    bool m_streaming;
+    bool m_refreshWhileCharging;
+    Accounting m_accounting;
+    QStringList m_paths;
 };
 
+Q_DECLARE_METATYPE(DiskUsage::Accounting)
+
 #endif /* DISKUSAGE_H */
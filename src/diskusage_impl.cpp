@@ -32,95 +32,346 @@
 
 #include "diskusage.h"
 #include "diskusage_p.h"
+#include "diskusageindex_p.h"
+#include "diskusagescheduler_p.h"
+#include "diskusagewalker_p.h"
 
 #include <QDir>
-#include <QProcess>
+#include <QFile>
 #include <QDebug>
 #include <QDBusConnection>
 #include <QDBusMessage>
-#include <QDBusReply>
-#include <QStorageInfo>
+#include <QDBusPendingCall>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
 
-quint64 DiskUsageWorker::calculateSize(QString directory, QString *expandedPath, bool androidHomeExists)
-{
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <rpm/header.h>
+#include <rpm/rpmdb.h>
+#include <rpm/rpmlib.h>
+#include <rpm/rpmts.h>
+
+namespace {
+
+// Milliseconds between partial results while streaming
+const int ProgressInterval = 250;
+
+// Milliseconds to wait for apkd, and to reuse its answers for
+const int ApkdTimeout = 5000;
+const qint64 ApkdCacheTimeout = 30 * 1000;
 
-    // In lieu of wordexp(3) support in Qt, fake it
-    if (directory.startsWith("~/")) {
-        directory = QDir::homePath() + '/' + directory.mid(2);
+// The directories where a whole filesystem is mounted. The kernel flags
+// mountinfo with POLLPRI when the mount table changes, so it is only read
+// again after that.
+class MountTable
+{
+public:
+    MountTable()
+        : m_fd(::open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC))
+    {
+        if (m_fd < 0) {
+            qWarning() << "Could not open mountinfo:" << strerror(errno);
+        }
+        read();
     }
 
-    QString androidHome = QString("/home/.android");
-    if (!androidHomeExists && directory.startsWith(androidHome)) {
-        directory = directory.mid(androidHome.length());
+    ~MountTable()
+    {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
     }
 
-    if (expandedPath) {
-        *expandedPath = directory;
+    bool isMountRoot(const QString &path)
+    {
+        QMutexLocker locker(&m_mutex);
+
+        if (m_fd >= 0) {
+            struct pollfd fd = { m_fd, POLLPRI, 0 };
+            if (::poll(&fd, 1, 0) > 0 && (fd.revents & (POLLPRI | POLLERR))) {
+                read();
+            }
+        }
+
+        return path == "/" || m_mountRoots.contains(QDir::cleanPath(path));
     }
 
-    if (directory == "/") {
-        return QStorageInfo::root().bytesTotal() - QStorageInfo::root().bytesAvailable();
+private:
+    static QByteArray unescape(const QByteArray &field)
+    {
+        // Spaces and such are written as octal escapes, e.g. "\040"
+        QByteArray unescaped;
+        for (int i = 0; i < field.length(); ++i) {
+            if (field.at(i) == '\\' && i + 3 < field.length()) {
+                unescaped.append(char(field.mid(i + 1, 3).toInt(0, 8)));
+                i += 3;
+            } else {
+                unescaped.append(field.at(i));
+            }
+        }
+        return unescaped;
     }
 
-    QDir d(directory);
-    if (!d.exists() || !d.isReadable()) {
-        return 0L;
+    void read()
+    {
+        m_mountRoots.clear();
+        if (m_fd < 0) {
+            return;
+        }
+
+        QByteArray table;
+        char buffer[4096];
+        ssize_t count;
+        if (::lseek(m_fd, 0, SEEK_SET) < 0) {
+            return;
+        }
+        while ((count = ::read(m_fd, buffer, sizeof(buffer))) > 0) {
+            table.append(buffer, int(count));
+        }
+
+        foreach (const QByteArray &line, table.split('\n')) {
+            // "36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw"
+            // Bind mounts of a subdirectory have something else than "/" as
+            // the root, statvfs() there would give the whole filesystem
+            const QList<QByteArray> fields = line.split(' ');
+            if (fields.count() > 4 && fields.at(3) == "/") {
+                m_mountRoots.insert(QFile::decodeName(unescape(fields.at(4))));
+            }
+        }
     }
 
-    QProcess du;
-    du.start("du", QStringList() << "-sbx" << directory, QIODevice::ReadOnly);
-    du.waitForFinished();
-    if (du.exitStatus() != QProcess::NormalExit) {
-        qWarning() << "Could not determine size of:" << directory;
-        return 0L;
+    QMutex m_mutex;
+    QSet<QString> m_mountRoots;
+    int m_fd;
+};
+
+// The name and installed size of every package, read in a single pass
+QVector<QPair<QByteArray, quint64> > readInstalledPackages()
+{
+    // librpm keeps global state, so only one calculation may read at a time
+    static QMutex rpmMutex;
+    static bool rpmConfigured = false;
+
+    QMutexLocker locker(&rpmMutex);
+
+    if (!rpmConfigured) {
+        if (rpmReadConfigFiles(NULL, NULL) != 0) {
+            qWarning() << "Could not read RPM configuration";
+        }
+        rpmConfigured = true;
     }
-    QStringList size_directory = QString::fromUtf8(du.readAll()).split('\t');
 
-    if (size_directory.size() > 1) {
-        return size_directory[0].toULongLong();
+    QVector<QPair<QByteArray, quint64> > packages;
+
+    rpmts ts = rpmtsCreate();
+    rpmdbMatchIterator iterator = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
+    if (!iterator) {
+        qWarning() << "Could not read the RPM database";
+    } else {
+        while (Header header = rpmdbNextIterator(iterator)) {
+            const char *name = headerGetString(header, RPMTAG_NAME);
+            if (name) {
+                packages.append(qMakePair(QByteArray(name), quint64(headerGetNumber(header, RPMTAG_LONGSIZE))));
+            }
+        }
+        rpmdbFreeIterator(iterator);
     }
+    rpmtsFree(ts);
 
-    return 0L;
+    return packages;
 }
 
-quint64 DiskUsageWorker::calculateRpmSize(const QString &glob)
+}
+
+QObject *DiskUsageService::createScheduler(QObject *parent)
 {
-    QProcess rpm;
-    rpm.start("rpm", QStringList() << "-qa" << "--queryformat=%{name}|%{size}\\n" << glob, QIODevice::ReadOnly);
-    rpm.waitForFinished();
-    if (rpm.exitStatus() != QProcess::NormalExit) {
-        qWarning() << "Could not determine size of RPM packages matching:" << glob;
-        return 0L;
-    }
+    return new DiskUsageScheduler(parent);
+}
 
-    quint64 result = 0L;
+QList<quint64> DiskUsageWorker::calculateSizes(const QStringList &directories, DiskUsage::Accounting accounting,
+                                               const ProgressFunction &progress, const CancelFunction &cancelled,
+                                               int largestEntryCount, QVariantList *largestEntries,
+                                               const QStringList &subdirectories,
+                                               QList<quint64> *subdirectorySizes)
+{
+    QList<quint64> sizes;
+    QHash<QString, quint64> reportedSizes;
+    QStringList walkPaths;
+    QList<int> walkIndexes;
+
+    static MountTable mountTable;
 
-    QStringList lines = QString::fromUtf8(rpm.readAll()).split('\n', QString::SkipEmptyParts);
-    foreach (const QString &line, lines) {
-        int index = line.indexOf('|');
-        if (index == -1) {
-            qWarning() << "Could not parse RPM output line:" << line;
+    foreach (const QString &directory, directories) {
+        // What the filesystem reports is both exact and immediate
+        struct statvfs st;
+        if (mountTable.isMountRoot(directory)
+                && ::statvfs(QFile::encodeName(directory).constData(), &st) == 0) {
+            sizes.append(quint64(st.f_blocks - st.f_bavail) * st.f_frsize);
+            // Still walked for the largest entries or subdirectories, but
+            // the size stays
+            if (largestEntryCount > 0 || subdirectorySizes) {
+                walkIndexes.append(-1);
+                walkPaths.append(directory);
+            }
             continue;
         }
 
-        QString package = line.left(index);
-        result += line.mid(index+1).toULongLong();
+        sizes.append(0L);
+
+        QDir d(directory);
+        if (d.exists() && d.isReadable()) {
+            walkIndexes.append(sizes.count() - 1);
+            walkPaths.append(directory);
+        }
+    }
+
+    // Walk every remaining directory in one go, so that they are scanned in
+    // parallel, skipping whatever the index knows to be unchanged
+    if (!walkPaths.isEmpty()) {
+        const DiskUsageWalker::Accounting walkerAccounting = accounting == DiskUsage::AllocatedSize
+                ? DiskUsageWalker::AllocatedSize : DiskUsageWalker::ApparentSize;
+        DiskUsageIndex *index = DiskUsageIndex::instance(walkerAccounting);
+        index->sync();
+
+        DiskUsageWalker walker;
+        walker.setAccounting(walkerAccounting);
+        walker.setIndex(index);
+        walker.setCancelFunction(cancelled);
+        walker.setLargestEntryCount(largestEntryCount);
+        if (subdirectorySizes) {
+            walker.setReportedDirectories(subdirectories);
+        }
+        if (progress) {
+            walker.setProgressFunction([&](const QList<quint64> &walked) {
+                QList<quint64> partialSizes(sizes);
+                for (int i = 0; i < walkIndexes.count(); ++i) {
+                    if (walkIndexes.at(i) >= 0) {
+                        partialSizes[walkIndexes.at(i)] = walked.value(i);
+                    }
+                }
+                progress(partialSizes);
+            }, ProgressInterval);
+        }
+
+        const QList<quint64> walked = walker.walk(walkPaths);
+        for (int i = 0; i < walkIndexes.count(); ++i) {
+            if (walkIndexes.at(i) >= 0) {
+                sizes[walkIndexes.at(i)] = walked.value(i);
+            }
+        }
+
+        reportedSizes = walker.reportedSizes();
+
+        if (largestEntries) {
+            foreach (const DiskUsageWalker::Entry &entry, walker.largestEntries()) {
+                QVariantMap map;
+                map.insert("path", QFile::decodeName(entry.path));
+                map.insert("size", entry.size);
+                map.insert("isDirectory", entry.directory);
+                largestEntries->append(map);
+            }
+        }
+
+        index->save();
+    }
+
+    if (subdirectorySizes) {
+        foreach (const QString &subdirectory, subdirectories) {
+            subdirectorySizes->append(reportedSizes.value(QDir::cleanPath(subdirectory)));
+        }
+    }
+
+    return sizes;
+}
+
+QList<quint64> DiskUsageWorker::calculateRpmSizes(const QStringList &globs)
+{
+    const QVector<QPair<QByteArray, quint64> > packages = readInstalledPackages();
+
+    // Match every glob against the package names, an empty glob matching
+    // all packages
+    QList<quint64> sizes;
+    foreach (const QString &glob, globs) {
+        const QByteArray pattern(glob.toUtf8());
+        quint64 result = 0L;
+        for (QVector<QPair<QByteArray, quint64> >::const_iterator it = packages.cbegin(); it != packages.cend(); ++it) {
+            if (pattern.isEmpty() || fnmatch(pattern.constData(), it->first.constData(), 0) == 0) {
+                result += it->second;
+            }
+        }
+        sizes.append(result);
+    }
+
+    return sizes;
+}
+
+QVariantMap DiskUsageWorker::installedPackages()
+{
+    QVariantMap result;
+    const QVector<QPair<QByteArray, quint64> > packages = readInstalledPackages();
+    for (QVector<QPair<QByteArray, quint64> >::const_iterator it = packages.cbegin(); it != packages.cend(); ++it) {
+        result.insert(QString::fromUtf8(it->first), it->second);
     }
 
     return result;
 }
 
-quint64 DiskUsageWorker::calculateApkdSize(const QString &rest)
+// apkd only tells the data usage of all Android apps together, single apps
+// have their data directories walked by measure() instead.
+void DiskUsageWorker::queryApkdUsage(const ApkdUsageFunction &done)
 {
-    Q_UNUSED(rest)
+    static QMutex cacheMutex;
+    static QElapsedTimer clock;
+    static bool cached = false;
+    static quint64 cachedSize = 0;
+    static qint64 cachedTime = 0;
+
+    {
+        QMutexLocker locker(&cacheMutex);
+        if (!clock.isValid()) {
+            clock.start();
+        } else if (cached && clock.elapsed() - cachedTime < ApkdCacheTimeout) {
+            const quint64 size = cachedSize;
+            locker.unlock();
+            done(size);
+            return;
+        }
+    }
+
     QDBusMessage msg = QDBusMessage::createMethodCall("com.jolla.apkd",
             "/com/jolla/apkd", "com.jolla.apkd", "getAndroidAppDataUsage");
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(
+                QDBusConnection::systemBus().asyncCall(msg, ApkdTimeout), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [done](QDBusPendingCallWatcher *watcher) {
+        watcher->deleteLater();
 
-    QDBusReply<qulonglong> reply = QDBusConnection::systemBus().call(msg);
-    if (reply.isValid()) {
-        return quint64(reply.value());
-    }
+        QDBusPendingReply<qulonglong> reply(*watcher);
+        if (reply.isError()) {
+            qWarning() << "Could not determine Android app data usage:" << reply.error().message();
+            done(0);
+            return;
+        }
 
-    qWarning() << "Could not determine Android app data usage";
-    return 0L;
+        const quint64 size = reply.value();
+        {
+            QMutexLocker locker(&cacheMutex);
+            cached = true;
+            cachedSize = size;
+            cachedTime = clock.elapsed();
+        }
+        done(size);
+    });
 }
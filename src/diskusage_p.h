@@ -33,9 +33,21 @@
 #ifndef DISKUSAGE_P_H
 #define DISKUSAGE_P_H
 
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
 #include <QObject>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
 #include <QVariant>
-#include <QJSValue>
+
+#include <atomic>
+#include <functional>
+
+#include "diskusage.h"
+
+class QThread;
 
 class DiskUsageWorker : public QObject
 {
@@ -47,19 +59,164 @@ public:
 
     void scheduleQuit() { m_quit = true; }
 
+    // Stops the request if it is running, or skips it once it is
+    // submitted. Request ids must increase from one submission to the next,
+    // so that cancelling a finished request does not leave anything behind.
+    // Thread safe.
+    void cancel(int request);
+    bool isCancelled() const;
+
+    static void subtractNestedUsage(QVariantMap *usage, const QHash<QString, QString> &expandedPaths);
+
 public slots:
-    void submit(QStringList paths, QJSValue *callback);
+    void submit(QStringList paths, bool streaming, DiskUsage::Accounting accounting, int request);
+    void list(QString path, int maximumCount, DiskUsage::Accounting accounting, int request);
+
+signals:
+    // The sizes are reported as measured, nested paths are not subtracted
+    void progress(QVariantMap usage, QVariantMap expandedPaths, int request);
+    void finished(QVariantMap usage, QVariantMap expandedPaths, int request);
+
+    // Maps with name, path, size and isDirectory, largest first
+    void listed(QVariantList children, int request);
+
+private:
+    typedef std::function<void (const QList<quint64> &sizes)> ProgressFunction;
+    typedef std::function<bool ()> CancelFunction;
+    typedef std::function<void (const QVariantMap &usage, const QHash<QString, QString> &expandedPaths)> UsageFunction;
+    typedef std::function<void (quint64 size)> ApkdUsageFunction;
+    struct PendingUsage;
+
+    void begin(int request);
+    void end(int request);
+    QVariantMap calculate(QStringList paths, DiskUsage::Accounting accounting = DiskUsage::ApparentSize);
+    QVariantList listChildren(const QString &path, int maximumCount, DiskUsage::Accounting accounting);
+    QVariantMap attributeApplications(const QString &glob, DiskUsage::Accounting accounting);
+    // Calls done once the paths are measured, right away or later from the
+    // event loop of the thread when waiting for apkd
+    void measure(const QStringList &paths, bool streaming, DiskUsage::Accounting accounting,
+                 const UsageFunction &done);
+    void finishMeasuring(const QSharedPointer<PendingUsage> &pending);
+    QString expandPath(QString path, bool androidHomeExists) const;
+    // The sizes of subdirectories below the directories are taken from the
+    // same walk, in the order given
+    QList<quint64> calculateSizes(const QStringList &directories, DiskUsage::Accounting accounting,
+                                  const ProgressFunction &progress, const CancelFunction &cancelled,
+                                  int largestEntryCount = 0, QVariantList *largestEntries = 0,
+                                  const QStringList &subdirectories = QStringList(),
+                                  QList<quint64> *subdirectorySizes = 0);
+    QList<quint64> calculateRpmSizes(const QStringList &globs);
+    QVariantMap installedPackages();
+    // Asks apkd for the data usage of all Android apps. done gets the size
+    // from the event loop of the thread, or right away when it is cached.
+    void queryApkdUsage(const ApkdUsageFunction &done);
+
+    std::atomic<bool> m_quit;
+    QMutex m_cancelMutex;
+    QSet<int> m_cancelledRequests;
+    // Requests begun and not yet answered, which may still be waiting for
+    // apkd after a newer request has begun
+    QHash<int, QSharedPointer<std::atomic<bool> > > m_activeRequests;
+    int m_request;
+    QSharedPointer<std::atomic<bool> > m_requestCancelled;
+
+    friend class Ut_DiskUsage;
+    friend class Bench_DiskUsage;
+};
+
+// Shared by every DiskUsage in the process. Paths measured recently are
+// answered from a cache, and paths already being measured for another
+// request are waited for instead of being walked again.
+class DiskUsageService : public QObject
+{
+    Q_OBJECT
+
+public:
+    static DiskUsageService *instance();
+
+    explicit DiskUsageService(QObject *parent=0);
+    virtual ~DiskUsageService();
+
+    int request(const QStringList &paths, bool streaming,
+                DiskUsage::Accounting accounting = DiskUsage::ApparentSize);
+
+    // Lists the entries of a directory with their sizes, at most
+    // maximumCount of the largest ones if it is positive
+    int requestChildren(const QString &path, int maximumCount,
+                        DiskUsage::Accounting accounting = DiskUsage::ApparentSize);
+
+    void cancel(int request);
+
+    // Paths to measure again now and then while the device is charging and
+    // not used, to keep the index up to date. Empty paths remove the owner.
+    void setRefreshPaths(QObject *owner, const QStringList &paths,
+                         DiskUsage::Accounting accounting = DiskUsage::ApparentSize);
 
 signals:
-    void finished(QVariantMap usage, QJSValue *callback);
+    void progress(int request, QVariantMap usage);
+    void finished(int request, QVariantMap usage);
+    void childrenListed(int request, QVariantList children);
+
+    void submit(QStringList paths, bool streaming, DiskUsage::Accounting accounting, int batch);
+    void submitList(QString path, int maximumCount, DiskUsage::Accounting accounting, int batch);
+    void activeChanged(bool active);
+
+private slots:
+    void batchProgress(QVariantMap usage, QVariantMap expandedPaths, int batch);
+    void batchFinished(QVariantMap usage, QVariantMap expandedPaths, int batch);
+    void batchListed(QVariantList children, int batch);
+    void deliver(int request);
+    void refresh();
 
 private:
-    QVariantMap calculate(QStringList paths);
-    quint64 calculateSize(QString directory, QString *expandedPath, bool androidHomeExists);
-    quint64 calculateRpmSize(const QString &glob);
-    quint64 calculateApkdSize(const QString &rest);
+    // A DiskUsageScheduler, or null where scanning is not scheduled
+    static QObject *createScheduler(QObject *parent);
+
+    void updateActive();
+
+    // Sizes counted one way are not shared with requests counting the other
+    typedef QPair<int, QString> PathKey; // accounting, path
+
+    struct Measurement {
+        QVariant size;
+        QString expandedPath;
+        qint64 time;
+    };
+
+    // Paths submitted to the worker together
+    struct Batch {
+        Batch() : accounting(DiskUsage::ApparentSize) {}
+
+        QSet<int> requests;
+        QStringList paths;
+        DiskUsage::Accounting accounting;
+        QVariantMap partialUsage;
+        QVariantMap partialExpandedPaths;
+    };
+
+    struct Request {
+        Request() : streaming(false) {}
+
+        QStringList paths;
+        QSet<int> batches;
+        bool streaming;
+        QVariantMap usage;
+        QHash<QString, QString> expandedPaths;
+    };
 
-    bool m_quit;
+    QThread *m_thread;
+    DiskUsageWorker *m_worker;
+    QElapsedTimer m_clock;
+    QHash<PathKey, Measurement> m_cache;
+    QHash<PathKey, int> m_measuring; // -> batch
+    QHash<int, Batch> m_batches;
+    QHash<int, Request> m_requests;
+    QHash<int, int> m_listings; // batch -> request
+    QHash<QObject *, QPair<QStringList, DiskUsage::Accounting> > m_refreshPaths;
+    QObject *m_scheduler;
+    bool m_active;
+    int m_lastRequest;
+    int m_lastBatch;
 
     friend class Ut_DiskUsage;
 };
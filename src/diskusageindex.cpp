@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusageindex_p.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const quint32 IndexMagic = 0x44554958; // "DUIX"
+const quint32 IndexVersion = 1;
+
+// Records loaded from disk are dropped once they are older than this
+const qint64 MaximumPersistedAge = 24 * 60 * 60;
+
+// Seconds an mtime must be older than its record to be trusted unwatched
+const qint64 RacyInterval = 2;
+
+// Used when the limit of the system can't be read, the kernel default
+const int DefaultUserWatchLimit = 8192;
+
+const uint32_t WatchMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+int userWatchLimit()
+{
+    QFile file(QStringLiteral("/proc/sys/fs/inotify/max_user_watches"));
+    bool ok = false;
+    int limit = 0;
+    if (file.open(QIODevice::ReadOnly)) {
+        limit = file.readAll().trimmed().toInt(&ok);
+    }
+    return ok && limit > 0 ? limit : DefaultUserWatchLimit;
+}
+
+}
+
+DiskUsageIndex *DiskUsageIndex::instance(DiskUsageWalker::Accounting accounting)
+{
+    // Only created once used, as each has an inotify instance
+    if (accounting == DiskUsageWalker::AllocatedSize) {
+        static DiskUsageIndex allocatedIndex(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                                             + QStringLiteral("/systemsettings/diskusage-allocated.index"));
+        return &allocatedIndex;
+    }
+
+    static DiskUsageIndex index(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                                + QStringLiteral("/systemsettings/diskusage.index"));
+    return &index;
+}
+
+DiskUsageIndex::DiskUsageIndex(const QString &filePath)
+    : m_filePath(filePath)
+    , m_watchLimit(userWatchLimit() / 4)
+    , m_inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    , m_loaded(false)
+    , m_modified(false)
+    , m_watchLimitReached(false)
+{
+    if (m_inotifyFd < 0) {
+        qWarning() << "Could not initialize inotify, disk usage will not be cached:" << strerror(errno);
+    }
+}
+
+DiskUsageIndex::~DiskUsageIndex()
+{
+    // Closing the descriptor removes all the watches
+    if (m_inotifyFd >= 0) {
+        ::close(m_inotifyFd);
+    }
+}
+
+DiskUsageIndex::Key DiskUsageIndex::key(const struct stat &st)
+{
+    return Key(quint64(st.st_dev), quint64(st.st_ino));
+}
+
+qint64 DiskUsageIndex::mtime(const struct stat &st)
+{
+    return qint64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+void DiskUsageIndex::setWatchLimit(int count)
+{
+    QMutexLocker locker(&m_mutex);
+    m_watchLimit = count;
+}
+
+int DiskUsageIndex::watchCount() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_watchDescriptors.count();
+}
+
+void DiskUsageIndex::sync()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_loaded) {
+        m_loaded = true;
+        load();
+    }
+
+    readEvents();
+}
+
+bool DiskUsageIndex::lookup(const struct stat &st, const Key &parent, quint64 *size)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const Key directory(key(st));
+    QHash<Key, Record>::iterator it = m_records.find(directory);
+    if (it == m_records.end()) {
+        return false;
+    }
+
+    if (it->mtime != mtime(st)) {
+        m_records.erase(it);
+        m_modified = true;
+        removeWatch(directory);
+        return false;
+    }
+
+    if (it->parent != parent) {
+        it->parent = parent;
+        m_modified = true;
+    }
+
+    if (!it->complete || !it->watched) {
+        return false;
+    }
+
+    *size = it->size;
+    return true;
+}
+
+bool DiskUsageIndex::lookupFiles(const Key &key, qint64 mtime, quint64 *filesSize)
+{
+    QMutexLocker locker(&m_mutex);
+
+    QHash<Key, Record>::const_iterator it = m_records.constFind(key);
+    if (it == m_records.constEnd() || it->mtime != mtime || it->linkedFiles) {
+        return false;
+    }
+
+    // Not watched since, only records from an earlier process are trusted by
+    // their mtime, and not when a change in the same clock tick could have
+    // been missed
+    if (!it->watched && (!it->persisted || it->mtime / 1000000000 + RacyInterval > it->recorded)) {
+        return false;
+    }
+
+    *filesSize = it->filesSize;
+    return true;
+}
+
+bool DiskUsageIndex::watch(const QByteArray &path, const Key &key)
+{
+    if (m_inotifyFd < 0) {
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_watchDescriptors.contains(key)) {
+            return true;
+        }
+        if (m_watchDescriptors.count() >= m_watchLimit) {
+            if (!m_watchLimitReached) {
+                m_watchLimitReached = true;
+                qWarning() << "Disk usage uses" << m_watchLimit << "inotify watches at most, it will only be partially cached";
+            }
+            return false;
+        }
+    }
+
+    const int wd = inotify_add_watch(m_inotifyFd, path.constData(), WatchMask);
+    const int error = errno;
+
+    QMutexLocker locker(&m_mutex);
+    if (wd < 0) {
+        if (error == ENOSPC && !m_watchLimitReached) {
+            m_watchLimitReached = true;
+            qWarning() << "Out of inotify watches, disk usage will only be partially cached";
+        }
+        return false;
+    }
+
+    m_watches.insert(wd, key);
+    m_watchDescriptors.insert(key, wd);
+    return true;
+}
+
+void DiskUsageIndex::unwatch(const Key &key)
+{
+    QMutexLocker locker(&m_mutex);
+    removeWatch(key);
+}
+
+void DiskUsageIndex::store(const Key &key, const Key &parent, qint64 mtime, quint64 filesSize, bool linkedFiles,
+                           quint64 size, bool complete)
+{
+    Record record;
+    record.parent = parent;
+    record.mtime = mtime;
+    record.filesSize = filesSize;
+    record.linkedFiles = linkedFiles;
+    record.size = size;
+    record.recorded = QDateTime::currentMSecsSinceEpoch() / 1000;
+    record.persisted = false;
+
+    QMutexLocker locker(&m_mutex);
+    record.watched = m_watchDescriptors.contains(key);
+    record.complete = complete && record.watched;
+    m_records.insert(key, record);
+    m_modified = true;
+}
+
+void DiskUsageIndex::readEvents()
+{
+    if (m_inotifyFd < 0) {
+        return;
+    }
+
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t count = ::read(m_inotifyFd, buffer, sizeof(buffer));
+        if (count <= 0) {
+            break;
+        }
+
+        for (char *ptr = buffer; ptr < buffer + count; ) {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Something was missed, nothing can be trusted any more
+                foreach (int wd, m_watches.keys()) {
+                    inotify_rm_watch(m_inotifyFd, wd);
+                }
+                m_watches.clear();
+                m_watchDescriptors.clear();
+                m_records.clear();
+                m_modified = true;
+                continue;
+            }
+
+            // Unknown once removed, the kernel still reports IN_IGNORED then
+            QHash<int, Key>::const_iterator it = m_watches.constFind(event->wd);
+            if (it != m_watches.constEnd()) {
+                // A copy, the watch goes away on the way
+                const Key key(it.value());
+                invalidate(key);
+            }
+        }
+    }
+}
+
+// The directory changed: its record is dropped along with its watch, and
+// the subtree sizes above it are not valid any more
+void DiskUsageIndex::invalidate(const Key &key)
+{
+    QHash<Key, Record>::iterator it = m_records.find(key);
+    if (it != m_records.end()) {
+        const Key parent(it->parent);
+        m_records.erase(it);
+        m_modified = true;
+        invalidateSize(parent);
+    }
+
+    removeWatch(key);
+}
+
+void DiskUsageIndex::invalidateSize(Key key)
+{
+    // A complete record only has complete records below it, so the first
+    // incomplete one ends the chain
+    for (;;) {
+        QHash<Key, Record>::iterator it = m_records.find(key);
+        if (it == m_records.end() || !it->complete) {
+            break;
+        }
+
+        it->complete = false;
+        key = it->parent;
+    }
+}
+
+void DiskUsageIndex::removeWatch(const Key &key)
+{
+    QHash<Key, int>::iterator it = m_watchDescriptors.find(key);
+    if (it == m_watchDescriptors.end()) {
+        return;
+    }
+
+    inotify_rm_watch(m_inotifyFd, it.value());
+    m_watches.remove(it.value());
+    m_watchDescriptors.erase(it);
+
+    // Changes are not seen any more
+    QHash<Key, Record>::iterator record = m_records.find(key);
+    if (record != m_records.end()) {
+        record->watched = false;
+    }
+    invalidateSize(key);
+}
+
+void DiskUsageIndex::load()
+{
+    QFile file(m_filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return;
+    }
+
+    QDataStream stream(&file);
+    quint32 magic, version, count;
+    stream >> magic >> version >> count;
+    if (magic != IndexMagic || version != IndexVersion) {
+        return;
+    }
+
+    const qint64 oldest = QDateTime::currentMSecsSinceEpoch() / 1000 - MaximumPersistedAge;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        Key key;
+        Record record;
+        stream >> key.first >> key.second >> record.parent.first >> record.parent.second
+               >> record.mtime >> record.filesSize >> record.linkedFiles >> record.recorded;
+        record.size = 0;
+        record.watched = false;
+        record.complete = false;
+        record.persisted = true;
+
+        if (stream.status() == QDataStream::Ok && record.recorded >= oldest) {
+            m_records.insert(key, record);
+        }
+    }
+}
+
+void DiskUsageIndex::save()
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (!m_modified) {
+        return;
+    }
+
+    QDir().mkpath(QFileInfo(m_filePath).absolutePath());
+
+    QSaveFile file(m_filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not save disk usage index:" << m_filePath << file.errorString();
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << IndexMagic << IndexVersion << quint32(m_records.count());
+    for (QHash<Key, Record>::const_iterator it = m_records.cbegin(), end = m_records.cend(); it != end; ++it) {
+        stream << it.key().first << it.key().second << it->parent.first << it->parent.second
+               << it->mtime << it->filesSize << it->linkedFiles << it->recorded;
+    }
+
+    if (file.commit()) {
+        m_modified = false;
+    } else {
+        qWarning() << "Could not save disk usage index:" << m_filePath << file.errorString();
+    }
+}
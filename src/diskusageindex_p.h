@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef DISKUSAGEINDEX_P_H
+#define DISKUSAGEINDEX_P_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+
+#include "diskusagewalker_p.h"
+
+struct stat;
+
+// Remembers the sizes of directories that have been walked, so that a
+// repeated calculation only lists the directories that changed since.
+//
+// Records are keyed by device and inode. Each one holds the directory's
+// mtime, the size of the files directly in it, and the size of the whole
+// subtree. Recorded directories are watched with inotify; a notification
+// drops the record of the directory and the subtree sizes of its ancestors.
+//
+// A subtree size is only used while every directory below has been watched
+// since it was recorded. Otherwise the subtree is walked again, but the files
+// of a directory whose mtime is unchanged are not looked at; their size is
+// taken from the record and only the subdirectories are visited.
+//
+// A file with several hard links is counted where the walk finds it first,
+// which differs from walk to walk. So the files of directories that have
+// such files are always looked at, and subtrees with them are not recorded
+// as complete. The link count of a file is not reported to the watch of its
+// directory though: a file that gains a link elsewhere while its directory
+// is unchanged is counted twice until the directory changes too.
+//
+// Only the mtimes and file sizes are saved to disk, as nothing watched the
+// directories in between processes. A file that changes size in place does
+// not touch the mtime of its directory, so those records are used for
+// MaximumPersistedAge at most.
+//
+// A quarter of the inotify watches of the user are used at most, the rest
+// are left to other applications. Directories beyond that are not watched,
+// so all their entries are looked at on every walk. The index of an
+// accounting is only created once that accounting is used.
+class DiskUsageIndex
+{
+public:
+    typedef QPair<quint64, quint64> Key;
+
+    // The sizes of each accounting are kept in an index of their own
+    static DiskUsageIndex *instance(DiskUsageWalker::Accounting accounting);
+
+    explicit DiskUsageIndex(const QString &filePath);
+    ~DiskUsageIndex();
+
+    // Loads the index on first use, and applies pending notifications
+    void sync();
+    void save();
+
+    static Key key(const struct stat &st);
+
+    // Returns true and the subtree size if the directory described by st is
+    // known and nothing below it changed. The record is attached to parent,
+    // so that changes below it invalidate the parent too.
+    bool lookup(const struct stat &st, const Key &parent, quint64 *size);
+
+    // Returns true and the size of the files directly in the directory, if
+    // it is watched or was saved by an earlier process, its mtime is the one
+    // recorded and none of the files has other hard links
+    bool lookupFiles(const Key &key, qint64 mtime, quint64 *filesSize);
+
+    // Must be called before the directory is listed, so that no change made
+    // while listing it can be missed. Fails when out of watches.
+    bool watch(const QByteArray &path, const Key &key);
+
+    // Stops watching a directory whose subtree size is not known after all
+    void unwatch(const Key &key);
+
+    // complete when every directory below was watched and listed, so that
+    // size can be used for the whole subtree. linkedFiles when some of the
+    // files have other hard links.
+    void store(const Key &key, const Key &parent, qint64 mtime, quint64 filesSize, bool linkedFiles,
+               quint64 size, bool complete);
+
+    static qint64 mtime(const struct stat &st);
+
+    // The number of inotify watches to use at most
+    void setWatchLimit(int count);
+    int watchCount() const;
+
+private:
+    struct Record
+    {
+        Key parent;
+        qint64 mtime;
+        quint64 filesSize;
+        bool linkedFiles;
+        quint64 size;
+        qint64 recorded;
+        bool watched;
+        bool complete;
+        bool persisted;
+    };
+
+    void load();
+    void readEvents();
+    void invalidate(const Key &key);
+    void invalidateSize(Key key);
+    void removeWatch(const Key &key);
+
+    mutable QMutex m_mutex;
+    QString m_filePath;
+    QHash<Key, Record> m_records;
+    QHash<int, Key> m_watches;
+    QHash<Key, int> m_watchDescriptors;
+    int m_watchLimit;
+    int m_inotifyFd;
+    bool m_loaded;
+    bool m_modified;
+    bool m_watchLimitReached;
+};
+
+#endif /* DISKUSAGEINDEX_P_H */
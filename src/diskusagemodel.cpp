@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusagemodel.h"
+#include "diskusage_p.h"
+
+#include <QVector>
+
+struct DiskUsageModel::Node
+{
+    Node(Node *parent, int row, const QVariantMap &entry)
+        : parent(parent)
+        , row(row)
+        , name(entry.value("name").toString())
+        , path(entry.value("path").toString())
+        , size(entry.value("size").toULongLong())
+        , directory(entry.value("isDirectory").toBool())
+        , populated(false)
+        , request(0)
+    {
+    }
+
+    ~Node()
+    {
+        qDeleteAll(children);
+    }
+
+    Node * const parent;
+    const int row;
+    const QString name;
+    const QString path;
+    const quint64 size;
+    const bool directory;
+    bool populated;
+    int request;
+    QVector<Node *> children;
+};
+
+DiskUsageModel::DiskUsageModel(QObject *parent)
+    : QAbstractItemModel(parent)
+    , m_service(DiskUsageService::instance())
+    , m_root(0)
+    , m_maximumChildCount(0)
+    , m_accounting(DiskUsage::ApparentSize)
+{
+    connect(m_service, SIGNAL(childrenListed(int, QVariantList)),
+            this, SLOT(childrenListed(int, QVariantList)));
+
+    reset();
+}
+
+DiskUsageModel::~DiskUsageModel()
+{
+    foreach (int request, m_fetching.keys()) {
+        m_service->cancel(request);
+    }
+    delete m_root;
+}
+
+QString DiskUsageModel::path() const
+{
+    return m_path;
+}
+
+void DiskUsageModel::setPath(const QString &path)
+{
+    if (m_path != path) {
+        m_path = path;
+        refresh();
+        emit pathChanged();
+    }
+}
+
+int DiskUsageModel::maximumChildCount() const
+{
+    return m_maximumChildCount;
+}
+
+void DiskUsageModel::setMaximumChildCount(int count)
+{
+    if (m_maximumChildCount != count) {
+        m_maximumChildCount = count;
+        refresh();
+        emit maximumChildCountChanged();
+    }
+}
+
+DiskUsage::Accounting DiskUsageModel::accounting() const
+{
+    return m_accounting;
+}
+
+void DiskUsageModel::setAccounting(DiskUsage::Accounting accounting)
+{
+    if (m_accounting != accounting) {
+        m_accounting = accounting;
+        refresh();
+        emit accountingChanged();
+    }
+}
+
+bool DiskUsageModel::working() const
+{
+    return !m_fetching.isEmpty();
+}
+
+void DiskUsageModel::refresh()
+{
+    beginResetModel();
+    reset();
+    endResetModel();
+}
+
+void DiskUsageModel::reset()
+{
+    const bool wasWorking = working();
+    foreach (int request, m_fetching.keys()) {
+        m_service->cancel(request);
+    }
+    m_fetching.clear();
+
+    delete m_root;
+    QVariantMap entry;
+    entry.insert("path", m_path);
+    entry.insert("isDirectory", !m_path.isEmpty());
+    m_root = new Node(0, 0, entry);
+
+    if (wasWorking) {
+        emit workingChanged();
+    }
+}
+
+QHash<int, QByteArray> DiskUsageModel::roleNames() const
+{
+    QHash<int, QByteArray> roles;
+    roles[NameRole] = "name";
+    roles[PathRole] = "path";
+    roles[SizeRole] = "size";
+    roles[IsDirectoryRole] = "isDirectory";
+    roles[PopulatedRole] = "populated";
+    return roles;
+}
+
+DiskUsageModel::Node *DiskUsageModel::nodeAt(const QModelIndex &index) const
+{
+    return index.isValid() ? static_cast<Node *>(index.internalPointer()) : m_root;
+}
+
+QModelIndex DiskUsageModel::indexOf(Node *node) const
+{
+    return node == m_root ? QModelIndex() : createIndex(node->row, 0, node);
+}
+
+QModelIndex DiskUsageModel::index(int row, int column, const QModelIndex &parent) const
+{
+    const Node *node = nodeAt(parent);
+    if (column != 0 || row < 0 || row >= node->children.count()) {
+        return QModelIndex();
+    }
+    return createIndex(row, column, node->children.at(row));
+}
+
+QModelIndex DiskUsageModel::parent(const QModelIndex &index) const
+{
+    return index.isValid() ? indexOf(nodeAt(index)->parent) : QModelIndex();
+}
+
+int DiskUsageModel::rowCount(const QModelIndex &parent) const
+{
+    return nodeAt(parent)->children.count();
+}
+
+int DiskUsageModel::columnCount(const QModelIndex &) const
+{
+    return 1;
+}
+
+QVariant DiskUsageModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid()) {
+        return QVariant();
+    }
+
+    const Node *node = nodeAt(index);
+    switch (role) {
+    case Qt::DisplayRole:
+    case NameRole:
+        return node->name;
+    case PathRole:
+        return node->path;
+    case SizeRole:
+        return node->size;
+    case IsDirectoryRole:
+        return node->directory;
+    case PopulatedRole:
+        return node->populated;
+    default:
+        return QVariant();
+    }
+}
+
+bool DiskUsageModel::hasChildren(const QModelIndex &parent) const
+{
+    const Node *node = nodeAt(parent);
+    return node->directory && (!node->populated || !node->children.isEmpty());
+}
+
+bool DiskUsageModel::canFetchMore(const QModelIndex &parent) const
+{
+    const Node *node = nodeAt(parent);
+    return node->directory && !node->populated && !node->request;
+}
+
+void DiskUsageModel::fetchMore(const QModelIndex &parent)
+{
+    Node *node = nodeAt(parent);
+    if (!canFetchMore(parent)) {
+        return;
+    }
+
+    const bool wasWorking = working();
+    node->request = m_service->requestChildren(node->path, m_maximumChildCount, m_accounting);
+    m_fetching.insert(node->request, node);
+
+    if (!wasWorking) {
+        emit workingChanged();
+    }
+}
+
+void DiskUsageModel::childrenListed(int request, QVariantList children)
+{
+    Node *node = m_fetching.take(request);
+    if (!node) {
+        // For another model
+        return;
+    }
+
+    node->request = 0;
+    node->populated = true;
+
+    if (!children.isEmpty()) {
+        beginInsertRows(indexOf(node), 0, children.count() - 1);
+        for (int i = 0; i < children.count(); ++i) {
+            node->children.append(new Node(node, i, children.at(i).toMap()));
+        }
+        endInsertRows();
+    }
+
+    if (node != m_root) {
+        const QModelIndex index = indexOf(node);
+        emit dataChanged(index, index, QVector<int>() << PopulatedRole);
+    }
+
+    if (!working()) {
+        emit workingChanged();
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef DISKUSAGEMODEL_H
+#define DISKUSAGEMODEL_H
+
+#include <QAbstractItemModel>
+#include <QHash>
+
+#include <systemsettingsglobal.h>
+
+#include "diskusage.h"
+
+class DiskUsageService;
+
+// The entries of a directory tree with their disk usage, largest first.
+//
+// The top level rows are the entries of path. The entries of a directory are
+// listed when the view fetches more for it, and stay in the model once
+// listed. Subdirectory sizes come from the shared disk usage service, so
+// after the first level has been measured, deeper levels are answered from
+// the directory index instead of being walked again.
+class SYSTEMSETTINGS_EXPORT DiskUsageModel : public QAbstractItemModel
+{
+    Q_OBJECT
+    Q_PROPERTY(QString path READ path WRITE setPath NOTIFY pathChanged)
+    // At most this many of the largest entries are listed per directory,
+    // all of them if zero
+    Q_PROPERTY(int maximumChildCount READ maximumChildCount WRITE setMaximumChildCount NOTIFY maximumChildCountChanged)
+    // How the sizes of files are counted, DiskUsage.ApparentSize unless set
+    Q_PROPERTY(DiskUsage::Accounting accounting READ accounting WRITE setAccounting NOTIFY accountingChanged)
+    Q_PROPERTY(bool working READ working NOTIFY workingChanged)
+
+public:
+    enum {
+        NameRole = Qt::UserRole,
+        PathRole,
+        SizeRole,
+        IsDirectoryRole,
+        PopulatedRole
+    };
+
+    explicit DiskUsageModel(QObject *parent = 0);
+    ~DiskUsageModel();
+
+    QString path() const;
+    void setPath(const QString &path);
+
+    int maximumChildCount() const;
+    void setMaximumChildCount(int count);
+
+    DiskUsage::Accounting accounting() const;
+    void setAccounting(DiskUsage::Accounting accounting);
+
+    bool working() const;
+
+    // Forgets every listed directory and starts over
+    Q_INVOKABLE void refresh();
+
+    QHash<int, QByteArray> roleNames() const;
+
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const;
+    QModelIndex parent(const QModelIndex &index) const;
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role) const;
+
+    bool hasChildren(const QModelIndex &parent = QModelIndex()) const;
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
+
+signals:
+    void pathChanged();
+    void maximumChildCountChanged();
+    void accountingChanged();
+    void workingChanged();
+
+private slots:
+    void childrenListed(int request, QVariantList children);
+
+private:
+    struct Node;
+
+    Node *nodeAt(const QModelIndex &index) const;
+    QModelIndex indexOf(Node *node) const;
+    void reset();
+
+    DiskUsageService *m_service;
+    Node *m_root;
+    QHash<int, Node *> m_fetching; // request -> node
+    QString m_path;
+    int m_maximumChildCount;
+    DiskUsage::Accounting m_accounting;
+};
+
+#endif /* DISKUSAGEMODEL_H */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusagescheduler_p.h"
+#include "diskusagewalker_p.h"
+
+#include <QDateTime>
+#include <QDBusConnection>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+
+#include <mce/dbus-names.h>
+
+#include <limits.h>
+
+namespace {
+
+// Degrees Celsius from which scanning is slowed down, and kept to a minimum
+const int WarmTemperature = 40;
+const int HotTemperature = 45;
+
+// Microseconds to pause after each directory when kept to a minimum
+const int MinimumListingDelay = 20 * 1000;
+
+// Milliseconds between thermal readings, also when the battery state changes
+// more often
+const int ThermalInterval = 5 * 1000;
+
+// Seconds between opportunistic refreshes
+const qint64 RefreshInterval = 4 * 60 * 60;
+
+// Milliseconds of charging and inactivity before a refresh starts
+const int RefreshDelay = 60 * 1000;
+
+}
+
+DiskUsageScheduler::DiskUsageScheduler(QObject *parent)
+    : QObject(parent)
+    , m_battery(new BatteryStatus(this))
+    , m_lastRefresh(0)
+    , m_temperature(INT_MIN)
+    , m_inactive(false)
+    , m_active(false)
+{
+    m_thermalTimer.setInterval(ThermalInterval);
+    m_refreshTimer.setInterval(RefreshDelay);
+    m_refreshTimer.setSingleShot(true);
+    m_intervalTimer.setSingleShot(true);
+
+    connect(&m_thermalTimer, SIGNAL(timeout()), this, SLOT(readTemperature()));
+    connect(&m_refreshTimer, SIGNAL(timeout()), this, SIGNAL(refreshRequested()));
+    connect(&m_refreshTimer, &QTimer::timeout, this, [this]() {
+        m_lastRefresh = QDateTime::currentMSecsSinceEpoch() / 1000;
+        update();
+    });
+    connect(&m_intervalTimer, &QTimer::timeout, this, &DiskUsageScheduler::update);
+    connect(m_battery, &BatteryStatus::chargerStatusChanged, this, &DiskUsageScheduler::update);
+    connect(m_battery, &BatteryStatus::statusChanged, this, &DiskUsageScheduler::update);
+
+    QDBusConnection::systemBus().connect(MCE_SERVICE, MCE_SIGNAL_PATH,
+                                         MCE_SIGNAL_IF, MCE_INACTIVITY_SIG,
+                                         this, SLOT(inactivityChanged(bool)));
+
+    QDBusMessage msg = QDBusMessage::createMethodCall(MCE_SERVICE, MCE_REQUEST_PATH,
+                                                      MCE_REQUEST_IF, MCE_INACTIVITY_STATUS_GET);
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(QDBusConnection::systemBus().asyncCall(msg), this);
+    connect(watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+            this, SLOT(initialInactivity(QDBusPendingCallWatcher*)));
+
+    update();
+}
+
+DiskUsageScheduler::~DiskUsageScheduler()
+{
+    DiskUsageWalker::setThrottle(0, 0);
+}
+
+int DiskUsageScheduler::temperature()
+{
+    int temperature = INT_MIN;
+    const QStringList zones = QDir("/sys/class/thermal").entryList(QStringList() << "thermal_zone*", QDir::Dirs);
+    foreach (const QString &zone, zones) {
+        QFile file(QString("/sys/class/thermal/%1/temp").arg(zone));
+        if (file.open(QIODevice::ReadOnly)) {
+            bool ok = false;
+            // Millidegrees
+            const int value = file.readAll().trimmed().toInt(&ok);
+            if (ok) {
+                temperature = qMax(temperature, value / 1000);
+            }
+        }
+    }
+    return temperature;
+}
+
+void DiskUsageScheduler::setActive(bool active)
+{
+    if (m_active != active) {
+        m_active = active;
+        if (active) {
+            m_thermalTimer.start();
+        } else {
+            m_thermalTimer.stop();
+        }
+        update();
+    }
+}
+
+void DiskUsageScheduler::readTemperature()
+{
+    m_temperature = temperature();
+    m_temperatureClock.start();
+    update();
+}
+
+void DiskUsageScheduler::update()
+{
+    const bool charging = m_battery->chargerStatus() == BatteryStatus::Connected;
+    const BatteryStatus::Status status = m_battery->status();
+    const bool low = status == BatteryStatus::Low || status == BatteryStatus::Empty;
+
+    // The temperature matters for scanning only, and for starting a refresh
+    if ((m_active || (charging && m_inactive))
+            && (!m_temperatureClock.isValid() || m_temperatureClock.elapsed() >= ThermalInterval)) {
+        m_temperature = temperature();
+        m_temperatureClock.start();
+    }
+
+    // Charging heats the device up already
+    if (m_temperature >= HotTemperature || (low && !charging)) {
+        DiskUsageWalker::setThrottle(1, MinimumListingDelay);
+    } else if (m_temperature >= WarmTemperature || charging) {
+        DiskUsageWalker::setThrottle(qMax(1, DiskUsageWalker::defaultThreadCount() / 2), 0);
+    } else {
+        DiskUsageWalker::setThrottle(0, 0);
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    const bool idle = charging && m_inactive && !m_active && m_temperature < WarmTemperature;
+    const bool refresh = idle && now - m_lastRefresh >= RefreshInterval;
+    if (refresh && !m_refreshTimer.isActive()) {
+        m_refreshTimer.start();
+    } else if (!refresh) {
+        m_refreshTimer.stop();
+    }
+
+    // No signal may come while the device stays charging and inactive, so
+    // look again once the interval has passed
+    if (idle && !refresh) {
+        m_intervalTimer.start(int(qMin<qint64>(RefreshInterval - (now - m_lastRefresh), RefreshInterval)) * 1000);
+    } else {
+        m_intervalTimer.stop();
+    }
+}
+
+void DiskUsageScheduler::inactivityChanged(bool inactive)
+{
+    m_inactive = inactive;
+    update();
+}
+
+void DiskUsageScheduler::initialInactivity(QDBusPendingCallWatcher *watcher)
+{
+    QDBusPendingReply<bool> reply = *watcher;
+    if (reply.isError()) {
+        qWarning() << "Could not get inactivity status:" << reply.error().message();
+    } else {
+        inactivityChanged(reply.value());
+    }
+    watcher->deleteLater();
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef DISKUSAGESCHEDULER_P_H
+#define DISKUSAGESCHEDULER_P_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+#include "batterystatus.h"
+
+class QDBusPendingCallWatcher;
+
+// Slows disk usage scanning down when the device is warm, charging or low on
+// battery, and asks for a refresh of the recently measured paths when the
+// device is charging and nobody is using it, so that the index stays up to
+// date.
+//
+// The thermal zones are only read while a scan runs or a refresh could
+// start, and once in ThermalInterval at most. The limits apply to the
+// scanner threads through DiskUsageWalker::setThrottle().
+class DiskUsageScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DiskUsageScheduler(QObject *parent = 0);
+    ~DiskUsageScheduler();
+
+    // Highest temperature of the thermal zones in degrees Celsius, or
+    // INT_MIN if none can be read
+    static int temperature();
+
+public slots:
+    void setActive(bool active);
+
+signals:
+    void refreshRequested();
+
+private slots:
+    void update();
+    void readTemperature();
+    void inactivityChanged(bool inactive);
+    void initialInactivity(QDBusPendingCallWatcher *watcher);
+
+private:
+    BatteryStatus *m_battery;
+    QTimer m_thermalTimer;
+    QTimer m_refreshTimer;
+    QTimer m_intervalTimer;
+    QElapsedTimer m_temperatureClock;
+    qint64 m_lastRefresh;
+    int m_temperature;
+    bool m_inactive;
+    bool m_active;
+};
+
+#endif /* DISKUSAGESCHEDULER_P_H */
@@ -0,0 +1,840 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusagewalker_p.h"
+#include "diskusageindex_p.h"
+
+#include <QByteArray>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QSet>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+const int MaximumDefaultThreadCount = 8;
+
+// Set by DiskUsageWalker::setThrottle(), shared by all walks
+std::atomic<int> throttleThreadCount(0);
+std::atomic<int> throttleListingDelay(0);
+
+// From linux/ioprio.h, which is not exported by the libc headers
+const int IoprioWhoProcess = 1;
+const int IoprioClassIdle = 3;
+const int IoprioClassShift = 13;
+
+// Not exported by the libc headers
+struct linux_dirent64
+{
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+bool isDotOrDotDot(const char *name)
+{
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Hard linked files seen so far, as 64 bit hashes of device and inode in an
+// open addressing table. The table grows up to MaximumInodeSetCapacity slots,
+// 4 MB, and is never filled beyond half; after that insert() fails.
+class InodeSet
+{
+public:
+    enum Result { Inserted, Present, Full };
+
+    InodeSet() : m_count(0) {}
+
+    Result insert(const struct stat &st)
+    {
+        const quint64 hash = hashOf(st);
+        if (m_slots.isEmpty()) {
+            m_slots.fill(0, InitialInodeSetCapacity);
+        }
+
+        const int mask = m_slots.count() - 1;
+        for (int i = int(hash) & mask; ; i = (i + 1) & mask) {
+            if (m_slots.at(i) == hash) {
+                return Present;
+            } else if (m_slots.at(i) == 0) {
+                break;
+            }
+        }
+
+        if (2 * (m_count + 1) > m_slots.count()) {
+            if (m_slots.count() == MaximumInodeSetCapacity) {
+                return Full;
+            }
+            grow();
+        }
+
+        place(hash);
+        ++m_count;
+        return Inserted;
+    }
+
+private:
+    static const int InitialInodeSetCapacity = 1024;
+    static const int MaximumInodeSetCapacity = 512 * 1024;
+
+    static quint64 hashOf(const struct stat &st)
+    {
+        // splitmix64 finalizer, zero marks free slots
+        quint64 x = quint64(st.st_ino) ^ (quint64(st.st_dev) * 0x9e3779b97f4a7c15ULL);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x ? x : 1;
+    }
+
+    void place(quint64 hash)
+    {
+        const int mask = m_slots.count() - 1;
+        int i = int(hash) & mask;
+        while (m_slots.at(i) != 0) {
+            i = (i + 1) & mask;
+        }
+        m_slots[i] = hash;
+    }
+
+    void grow()
+    {
+        const QVector<quint64> slots(m_slots);
+        m_slots.fill(0, slots.count() * 2);
+        foreach (quint64 hash, slots) {
+            if (hash) {
+                place(hash);
+            }
+        }
+    }
+
+    QVector<quint64> m_slots;
+    int m_count;
+};
+
+// The largest entries seen so far, as a min-heap of at most count entries
+class LargestEntries
+{
+public:
+    explicit LargestEntries(int count) : m_count(count) {}
+
+    // Cheap test to do before building the path
+    bool accepts(quint64 size) const
+    {
+        return m_count > 0 && (m_heap.count() < m_count || size > m_heap.first().size);
+    }
+
+    void add(const QByteArray &path, quint64 size, bool directory)
+    {
+        if (!accepts(size)) {
+            return;
+        }
+
+        if (m_heap.count() == m_count) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), larger);
+            m_heap.removeLast();
+        }
+        const DiskUsageWalker::Entry entry = { path, size, directory };
+        m_heap.append(entry);
+        std::push_heap(m_heap.begin(), m_heap.end(), larger);
+    }
+
+    const QVector<DiskUsageWalker::Entry> &entries() const
+    {
+        return m_heap;
+    }
+
+private:
+    static bool larger(const DiskUsageWalker::Entry &a, const DiskUsageWalker::Entry &b)
+    {
+        return a.size > b.size;
+    }
+
+    const int m_count;
+    QVector<DiskUsageWalker::Entry> m_heap;
+};
+
+// One of the paths passed to DiskUsageWalker::walk()
+struct Root
+{
+    explicit Root(DiskUsageWalker::Accounting accounting)
+        : accounting(accounting), size(0), running(0), finished(false) {}
+
+    quint64 sizeOf(const struct stat &st) const
+    {
+        return accounting == DiskUsageWalker::AllocatedSize
+                ? quint64(st.st_blocks) * 512 : quint64(st.st_size);
+    }
+
+    // Counts a file once however many of its links are found. Once too many
+    // hard linked files have been seen, every link counts for its share.
+    quint64 linkedSize(const struct stat &st)
+    {
+        InodeSet::Result result;
+        {
+            QMutexLocker locker(&mutex);
+            result = seenInodes.insert(st);
+        }
+
+        switch (result) {
+        case InodeSet::Inserted:
+            return sizeOf(st);
+        case InodeSet::Present:
+            return 0;
+        case InodeSet::Full:
+            break;
+        }
+        return sizeOf(st) / quint64(st.st_nlink);
+    }
+
+    quint64 currentSize() const
+    {
+        return finished.load() ? size : running.load();
+    }
+
+    const DiskUsageWalker::Accounting accounting;
+    quint64 size;
+
+    // What has been counted so far, for progress reports
+    std::atomic<quint64> running;
+    std::atomic<bool> finished;
+
+    QMutex mutex;
+    InodeSet seenInodes;
+};
+
+// A directory waiting to be listed, or one whose subdirectories are still
+// being measured. pending counts the node's own listing plus every child that
+// has not completed yet; the last one to finish adds the total to the parent.
+// listed is set once the node's own entries have all been counted, and
+// filesSize is then what its files add up to. complete is cleared when some
+// part of the subtree could not be listed or watched, in which case the size
+// of the subtree must not go into the index. Neither must it when links is
+// set, as some file below has hard links and the walk that finds them first
+// gets their size.
+struct Node
+{
+    Node(Node *parent, Root *root, const QByteArray &path, const struct stat &st,
+         const DiskUsageIndex::Key &parentKey, int fd = -1)
+        : parent(parent), root(root), path(path), device(st.st_dev)
+        , key(DiskUsageIndex::key(st)), parentKey(parentKey), mtime(DiskUsageIndex::mtime(st))
+        , fd(fd), filesSize(0), linkedFiles(false), listed(false), watched(false)
+        , size(root->sizeOf(st)), pending(1), complete(true), links(false)
+    {
+    }
+
+    Node * const parent;
+    Root * const root;
+    const QByteArray path;
+    const dev_t device;
+    const DiskUsageIndex::Key key;
+    const DiskUsageIndex::Key parentKey;
+    const qint64 mtime;
+    int fd;
+
+    // Only written while listing, read once the node is done
+    quint64 filesSize;
+    bool linkedFiles;
+    bool listed;
+    bool watched;
+
+    std::atomic<quint64> size;
+    std::atomic<int> pending;
+    std::atomic<bool> complete;
+    std::atomic<bool> links;
+};
+
+class ScanPool
+{
+public:
+    ScanPool(int queueCount, DiskUsageIndex *index, const DiskUsageWalker::CancelFunction &cancelled,
+             bool lookups, const QStringList &reportedDirectories)
+        : m_index(index)
+        , m_cancelled(cancelled)
+        , m_lookups(lookups)
+        , m_outstanding(0)
+    {
+        for (int i = 0; i < queueCount; ++i) {
+            m_queues.append(new Queue);
+        }
+
+        foreach (const QString &directory, reportedDirectories) {
+            QByteArray path(QFile::encodeName(QDir::cleanPath(directory)));
+            m_reported.insert(path);
+            for (int i; (i = path.lastIndexOf('/')) >= 0; ) {
+                path.truncate(i > 0 ? i : 1);
+                if (m_ancestors.contains(path)) {
+                    break;
+                }
+                m_ancestors.insert(path);
+                if (i == 0) {
+                    break;
+                }
+            }
+        }
+    }
+
+    ~ScanPool()
+    {
+        qDeleteAll(m_queues);
+    }
+
+    void push(int queue, Node *node)
+    {
+        ++m_outstanding;
+        {
+            Queue *q = m_queues.at(queue);
+            QMutexLocker locker(&q->mutex);
+            q->nodes.push_back(node);
+        }
+        m_idle.wakeOne();
+    }
+
+    // Returns the next directory to list, or 0 once every queue is empty and
+    // no directory is being listed any more.
+    Node *next(int queue)
+    {
+        for (;;) {
+            // Threads beyond the throttled count only wait for the end, the
+            // others steal what is in their queues
+            const int threadCount = throttleThreadCount.load();
+            const bool parked = threadCount > 0 && queue >= threadCount;
+            if (!parked) {
+                if (Node *node = takeBack(queue)) {
+                    return node;
+                }
+                for (int i = 1, n = m_queues.count(); i < n; ++i) {
+                    if (Node *node = takeFront((queue + i) % n)) {
+                        return node;
+                    }
+                }
+            }
+
+            QMutexLocker locker(&m_idleMutex);
+            if (m_outstanding.load() == 0) {
+                m_idle.wakeAll();
+                return 0;
+            }
+            // Timed, so that a push between the checks above and this wait
+            // can't leave the thread sleeping
+            m_idle.wait(&m_idleMutex, parked ? 50 : 5);
+        }
+    }
+
+    DiskUsageIndex *index() const
+    {
+        return m_index;
+    }
+
+    // False when every entry must be seen, even in unchanged directories
+    bool lookups() const
+    {
+        return m_lookups;
+    }
+
+    bool hasReported() const
+    {
+        return !m_reported.isEmpty();
+    }
+
+    // A directory with reported directories below, which must be listed
+    bool leadsToReported(const QByteArray &path) const
+    {
+        return m_ancestors.contains(path);
+    }
+
+    void report(const QByteArray &path, quint64 size)
+    {
+        if (m_reported.contains(path)) {
+            QMutexLocker locker(&m_reportMutex);
+            m_reportedSizes.insert(QFile::decodeName(path), size);
+        }
+    }
+
+    QHash<QString, quint64> reportedSizes() const
+    {
+        return m_reportedSizes;
+    }
+
+    bool isCancelled() const
+    {
+        return m_cancelled && m_cancelled();
+    }
+
+    // Called once the node's own entries have been listed
+    void done(Node *node, LargestEntries *largest)
+    {
+        while (node && node->pending.fetch_sub(1) == 1) {
+            Node *parent = node->parent;
+            const quint64 size = node->size.load();
+            if (!m_reported.isEmpty()) {
+                report(node->path, size);
+            }
+            if (m_index) {
+                if (node->listed) {
+                    m_index->store(node->key, node->parentKey, node->mtime, node->filesSize,
+                                   node->linkedFiles, size, node->complete.load() && !node->links.load());
+                }
+                // The watch is of no use without a subtree size, leave it to others
+                if (node->watched && !node->complete.load()) {
+                    m_index->unwatch(node->key);
+                }
+            }
+            if (parent) {
+                largest->add(node->path, size, true);
+                parent->size += size;
+                if (!node->complete.load()) {
+                    parent->complete = false;
+                }
+                if (node->links.load()) {
+                    parent->links = true;
+                }
+            } else {
+                node->root->size = size;
+                node->root->finished = true;
+            }
+            delete node;
+            node = parent;
+        }
+
+        if (m_outstanding.fetch_sub(1) == 1) {
+            QMutexLocker locker(&m_idleMutex);
+            m_idle.wakeAll();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        QMutex mutex;
+        std::deque<Node *> nodes;
+    };
+
+    Node *takeBack(int queue)
+    {
+        Queue *q = m_queues.at(queue);
+        QMutexLocker locker(&q->mutex);
+        if (q->nodes.empty()) {
+            return 0;
+        }
+        Node *node = q->nodes.back();
+        q->nodes.pop_back();
+        return node;
+    }
+
+    Node *takeFront(int queue)
+    {
+        Queue *q = m_queues.at(queue);
+        QMutexLocker locker(&q->mutex);
+        if (q->nodes.empty()) {
+            return 0;
+        }
+        Node *node = q->nodes.front();
+        q->nodes.pop_front();
+        return node;
+    }
+
+    DiskUsageIndex * const m_index;
+    const DiskUsageWalker::CancelFunction m_cancelled;
+    const bool m_lookups;
+    QSet<QByteArray> m_reported;
+    QSet<QByteArray> m_ancestors;
+    QMutex m_reportMutex;
+    QHash<QString, quint64> m_reportedSizes;
+    QVector<Queue *> m_queues;
+    std::atomic<int> m_outstanding;
+
+    QMutex m_idleMutex;
+    QWaitCondition m_idle;
+};
+
+class Scanner : public QThread
+{
+public:
+    Scanner(ScanPool *pool, int queue, int largestEntryCount)
+        : m_pool(pool)
+        , m_queue(queue)
+        , m_largest(largestEntryCount)
+    {
+    }
+
+    const LargestEntries &largest() const
+    {
+        return m_largest;
+    }
+
+protected:
+    void run() override
+    {
+        // Threads are started with SCHED_IDLE, give their I/O the idle class too
+        if (::syscall(SYS_ioprio_set, IoprioWhoProcess, 0, IoprioClassIdle << IoprioClassShift) < 0) {
+            qWarning() << "Could not set idle I/O priority for disk usage scanning:" << strerror(errno);
+        }
+
+        // Once cancelled, the remaining directories are completed without
+        // being listed, which frees them and their parents
+        while (Node *node = m_pool->next(m_queue)) {
+            if (m_pool->isCancelled()) {
+                node->complete = false;
+                if (node->fd >= 0) {
+                    ::close(node->fd);
+                }
+            } else {
+                list(node);
+            }
+            m_pool->done(node, &m_largest);
+
+            // Spreads the reads out when throttled
+            const int delay = throttleListingDelay.load();
+            if (delay > 0 && !m_pool->isCancelled()) {
+                ::usleep(delay);
+            }
+        }
+    }
+
+private:
+    void list(Node *node)
+    {
+        node->root->running += node->size.load();
+
+        DiskUsageIndex *index = m_pool->index();
+        if (index) {
+            node->watched = index->watch(node->path, node->key);
+            if (!node->watched) {
+                node->complete = false;
+            }
+        }
+
+        int fd = node->fd;
+        if (fd < 0) {
+            fd = ::open(node->path.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                node->complete = false;
+                return;
+            }
+        }
+
+        // Unchanged since recorded, also after the watch was set: only the
+        // subdirectories need to be looked at
+        quint64 filesSize = 0L;
+        bool knownFiles = false;
+        if (index && m_pool->lookups()) {
+            struct stat st;
+            knownFiles = ::fstat(fd, &st) == 0 && DiskUsageIndex::mtime(st) == node->mtime
+                    && index->lookupFiles(node->key, node->mtime, &filesSize);
+        }
+
+        const QByteArray prefix(node->path.endsWith('/') ? node->path : node->path + '/');
+        quint64 total = knownFiles ? filesSize : 0L;
+        bool linkedFiles = false;
+        bool listed = true;
+        bool cancelled = false;
+
+        while (!cancelled) {
+            long count = ::syscall(SYS_getdents64, fd, m_buffer, sizeof(m_buffer));
+            if (count <= 0) {
+                if (count < 0) {
+                    qWarning() << "Could not read directory entries:" << node->path << strerror(errno);
+                    node->complete = false;
+                    listed = false;
+                }
+                break;
+            }
+
+            const char *buffer = reinterpret_cast<const char *>(m_buffer);
+            for (long offset = 0; offset < count; ) {
+                const linux_dirent64 *entry = reinterpret_cast<const linux_dirent64 *>(buffer + offset);
+                offset += entry->d_reclen;
+
+                if (isDotOrDotDot(entry->d_name)) {
+                    continue;
+                }
+
+                if (m_pool->isCancelled()) {
+                    node->complete = false;
+                    listed = false;
+                    cancelled = true;
+                    break;
+                }
+
+                if (knownFiles && entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+                    continue;
+                }
+
+                struct stat st;
+                if (::fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    continue;
+                }
+
+                // Same as du -x: don't count or descend into other filesystems
+                if (st.st_dev != node->device) {
+                    continue;
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                    quint64 size;
+                    const QByteArray path(m_pool->hasReported() ? prefix + entry->d_name : QByteArray());
+                    if (index && m_pool->lookups() && !m_pool->leadsToReported(path)
+                            && index->lookup(st, node->key, &size)) {
+                        if (m_pool->hasReported()) {
+                            m_pool->report(path, size);
+                        }
+                        total += size;
+                        if (m_largest.accepts(size)) {
+                            m_largest.add(prefix + entry->d_name, size, true);
+                        }
+                    } else {
+                        ++node->pending;
+                        m_pool->push(m_queue, new Node(node, node->root, prefix + entry->d_name, st, node->key));
+                    }
+                } else if (!knownFiles) {
+                    quint64 size;
+                    if (st.st_nlink < 2) {
+                        size = node->root->sizeOf(st);
+                    } else {
+                        size = node->root->linkedSize(st);
+                        linkedFiles = true;
+                    }
+                    total += size;
+                    filesSize += size;
+                    if (m_largest.accepts(size)) {
+                        m_largest.add(prefix + entry->d_name, size, false);
+                    }
+                }
+            }
+        }
+
+        ::close(fd);
+        node->filesSize = filesSize;
+        node->linkedFiles = linkedFiles;
+        node->listed = listed;
+        if (linkedFiles) {
+            node->links = true;
+        }
+        node->size += total;
+        node->root->running += total;
+    }
+
+    ScanPool * const m_pool;
+    const int m_queue;
+    LargestEntries m_largest;
+
+    // getdents64() output, kept 8 byte aligned for struct linux_dirent64
+    quint64 m_buffer[4096];
+};
+
+}
+
+DiskUsageWalker::DiskUsageWalker(int maximumThreadCount)
+    : m_maximumThreadCount(maximumThreadCount > 0 ? maximumThreadCount : defaultThreadCount())
+    , m_accounting(ApparentSize)
+    , m_index(0)
+    , m_progressInterval(0)
+    , m_largestEntryCount(0)
+{
+}
+
+DiskUsageWalker::~DiskUsageWalker()
+{
+}
+
+int DiskUsageWalker::defaultThreadCount()
+{
+    return qBound(1, QThread::idealThreadCount(), MaximumDefaultThreadCount);
+}
+
+void DiskUsageWalker::setAccounting(Accounting accounting)
+{
+    m_accounting = accounting;
+}
+
+void DiskUsageWalker::setIndex(DiskUsageIndex *index)
+{
+    m_index = index;
+}
+
+void DiskUsageWalker::setLargestEntryCount(int count)
+{
+    m_largestEntryCount = count;
+}
+
+QVector<DiskUsageWalker::Entry> DiskUsageWalker::largestEntries() const
+{
+    return m_largestEntries;
+}
+
+void DiskUsageWalker::setReportedDirectories(const QStringList &directories)
+{
+    m_reportedDirectories = directories;
+}
+
+QHash<QString, quint64> DiskUsageWalker::reportedSizes() const
+{
+    return m_reportedSizes;
+}
+
+void DiskUsageWalker::setThrottle(int threadCount, int listingDelay)
+{
+    throttleThreadCount = threadCount;
+    throttleListingDelay = listingDelay;
+}
+
+void DiskUsageWalker::setCancelFunction(const CancelFunction &cancelled)
+{
+    m_cancelled = cancelled;
+}
+
+void DiskUsageWalker::setProgressFunction(const ProgressFunction &progress, int interval)
+{
+    m_progress = progress;
+    m_progressInterval = interval;
+}
+
+QList<quint64> DiskUsageWalker::walk(const QStringList &paths)
+{
+    QList<Root *> roots;
+    ScanPool pool(m_maximumThreadCount, m_index, m_cancelled, m_largestEntryCount <= 0, m_reportedDirectories);
+
+    for (int i = 0; i < paths.count(); ++i) {
+        Root *root = new Root(m_accounting);
+        roots.append(root);
+
+        const QString &path = paths.at(i);
+        const QByteArray encodedPath(QFile::encodeName(path));
+        int fd = ::open(encodedPath.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            qWarning() << "Could not open directory:" << path << strerror(errno);
+            root->finished = true;
+            continue;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            qWarning() << "Could not stat directory:" << path << strerror(errno);
+            root->finished = true;
+            ::close(fd);
+            continue;
+        }
+
+        // Attach the path to its parent in the index, so that changes
+        // below it invalidate the parent directory as well
+        DiskUsageIndex::Key parentKey;
+        struct stat parentSt;
+        if (::fstatat(fd, "..", &parentSt, 0) == 0) {
+            parentKey = DiskUsageIndex::key(parentSt);
+        }
+
+        const QByteArray cleanPath(QFile::encodeName(QDir::cleanPath(path)));
+        if (m_index && m_largestEntryCount <= 0 && !pool.leadsToReported(cleanPath)
+                && m_index->lookup(st, parentKey, &root->size)) {
+            pool.report(cleanPath, root->size);
+            root->finished = true;
+            ::close(fd);
+            continue;
+        }
+
+        // Spread the starting points, so that every path gets a thread of
+        // its own before any stealing happens
+        Node *node = new Node(0, root, cleanPath, st, parentKey, fd);
+        pool.push(i % m_maximumThreadCount, node);
+    }
+
+    QList<Scanner *> threads;
+    for (int i = 0; i < m_maximumThreadCount; ++i) {
+        Scanner *thread = new Scanner(&pool, i, m_largestEntryCount);
+        threads.append(thread);
+        thread->start(QThread::IdlePriority);
+    }
+
+    // The calling thread only reports progress while the scanners run
+    foreach (Scanner *thread, threads) {
+        if (!m_progress) {
+            thread->wait();
+            continue;
+        }
+
+        while (!thread->wait(m_progressInterval)) {
+            QList<quint64> sizes;
+            foreach (Root *root, roots) {
+                sizes.append(root->currentSize());
+            }
+            m_progress(sizes);
+        }
+    }
+
+    // Every thread kept its own largest entries, merge them. Overlapping
+    // paths find the same entries more than once.
+    LargestEntries largest(m_largestEntryCount);
+    QSet<QByteArray> seenPaths;
+    foreach (Scanner *thread, threads) {
+        foreach (const Entry &entry, thread->largest().entries()) {
+            if (!seenPaths.contains(entry.path)) {
+                seenPaths.insert(entry.path);
+                largest.add(entry.path, entry.size, entry.directory);
+            }
+        }
+    }
+    qDeleteAll(threads);
+
+    m_largestEntries = largest.entries();
+    m_reportedSizes = pool.reportedSizes();
+    std::sort(m_largestEntries.begin(), m_largestEntries.end(), [](const Entry &a, const Entry &b) {
+        return a.size > b.size;
+    });
+
+    QList<quint64> sizes;
+    foreach (Root *root, roots) {
+        sizes.append(root->size);
+    }
+    qDeleteAll(roots);
+
+    return sizes;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#ifndef DISKUSAGEWALKER_P_H
+#define DISKUSAGEWALKER_P_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include <QVector>
+
+#include <functional>
+
+class DiskUsageIndex;
+
+// Measures directory trees in process, without forking du(1).
+//
+// With ApparentSize accounting the totals match "du -sbx": apparent sizes of
+// every entry (directories and symlinks included) that lives on the same
+// filesystem as the starting point, with hard linked files counted only once
+// per path. AllocatedSize counts the blocks allocated instead, like "du -sx",
+// which is what deleting the files would give back: sparse files count for
+// the data they hold only.
+//
+// Hard links are remembered in a bounded set; with more hard linked files
+// than fit, each further link counts for its share of the file size.
+//
+// All paths given to walk() are scanned at the same time. Every directory
+// found becomes a task on a bounded pool of scanner threads; each thread works
+// depth first on its own queue and steals the oldest, usually largest, pending
+// directories from the others when it runs dry.
+//
+// A progress function, when set, is called from the thread that called walk()
+// at the given interval in milliseconds with the size counted so far for each
+// path, or the final size for the paths that are done.
+//
+// The cancel function is polled for every directory entry; once it returns
+// true the walk stops as soon as possible and returns partial sizes. Scanner
+// threads run with the idle CPU scheduling and I/O priority classes.
+//
+// With an index set, directories whose size is already known and unchanged
+// are not listed again, and the files of unchanged directories are not
+// looked at. The sizes of the listed directories are stored.
+//
+// The walk can also keep the largest files and directories found below the
+// paths. Each scanner thread keeps a min-heap of that many entries, so the
+// memory needed does not depend on the size of the tree. Finding them means
+// listing every directory, so the index is only written to then.
+//
+// The sizes of chosen directories below the paths are kept as they are found,
+// so that a breakdown needs no second walk. The directories leading to them
+// are always listed, not looked up in the index.
+class DiskUsageWalker
+{
+public:
+    typedef std::function<void (const QList<quint64> &sizes)> ProgressFunction;
+    typedef std::function<bool ()> CancelFunction;
+
+    enum Accounting {
+        ApparentSize,
+        AllocatedSize
+    };
+
+    struct Entry {
+        QByteArray path;
+        quint64 size;
+        bool directory;
+    };
+
+    explicit DiskUsageWalker(int maximumThreadCount = 0);
+    ~DiskUsageWalker();
+
+    // An index must only be shared by walkers with the same accounting
+    void setAccounting(Accounting accounting);
+
+    void setIndex(DiskUsageIndex *index);
+    void setCancelFunction(const CancelFunction &cancelled);
+    void setProgressFunction(const ProgressFunction &progress, int interval);
+
+    void setLargestEntryCount(int count);
+    // The largest entries found by the last walk, largest first
+    QVector<Entry> largestEntries() const;
+
+    void setReportedDirectories(const QStringList &directories);
+    // The sizes of the reported directories found by the last walk, by
+    // their clean paths
+    QHash<QString, quint64> reportedSizes() const;
+
+    QList<quint64> walk(const QStringList &paths);
+
+    static int defaultThreadCount();
+
+    // Limits every walk, also those already running, to threadCount scanner
+    // threads and a pause of listingDelay microseconds after each directory.
+    // Zero lifts the limits.
+    static void setThrottle(int threadCount, int listingDelay);
+
+private:
+    int m_maximumThreadCount;
+    Accounting m_accounting;
+    DiskUsageIndex *m_index;
+    CancelFunction m_cancelled;
+    ProgressFunction m_progress;
+    int m_progressInterval;
+    int m_largestEntryCount;
+    QVector<Entry> m_largestEntries;
+    QStringList m_reportedDirectories;
+    QHash<QString, quint64> m_reportedSizes;
+
+    Q_DISABLE_COPY(DiskUsageWalker)
+};
+
+#endif /* DISKUSAGEWALKER_P_H */
@@ -45,6 +45,7 @@
 #include "developermodesettings.h"
 #include "batterystatus.h"
 #include "diskusage.h"
+#include "diskusagemodel.h"
 #include "partitionmodel.h"
 #include "certificatemodel.h"
 #include "settingsvpnmodel.h"
@@ -83,10 +84,12 @@ public:
         qRegisterMetaType<Partition>("Partition");
         qmlRegisterType<DeveloperModeSettings>(uri, 1, 0, "DeveloperModeSettings");
         qmlRegisterType<CertificateModel>(uri, 1, 0, "CertificateModel");
+        qmlRegisterType<CertificateAnalyzer>(uri, 1, 0, "CertificateAnalyzer");
         qmlRegisterSingletonType<SettingsVpnModel>(uri, 1, 0, "SettingsVpnModel", api_factory<SettingsVpnModel>);
         qRegisterMetaType<DeveloperModeSettings::Status>("DeveloperModeSettings::Status");
         qmlRegisterType<BatteryStatus>(uri, 1, 0, "BatteryStatus");
         qmlRegisterType<DiskUsage>(uri, 1, 0, "DiskUsage");
+        qmlRegisterType<DiskUsageModel>(uri, 1, 0, "DiskUsageModel");
         qmlRegisterType<LocationSettings>(uri, 1, 0, "LocationSettings");
         qmlRegisterType<DeviceInfo>(uri, 1, 0, "DeviceInfo");
     }
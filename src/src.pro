@@ -7,7 +7,7 @@ QT -= gui
 
 CONFIG += c++11 hide_symbols link_pkgconfig
 PKGCONFIG += profile mlite5 mce timed-qt5 libshadowutils blkid libcrypto nemomodels-qt5 libsailfishkeyprovider connman-qt5 glib-2.0
-PKGCONFIG += ssu-sysinfo nemodbus packagekitqt5
+PKGCONFIG += ssu-sysinfo nemodbus packagekitqt5 rpm
 
 system(qdbusxml2cpp -p mceiface.h:mceiface.cpp mce.xml)
 
@@ -21,11 +21,17 @@ SOURCES += \
     mceiface.cpp \
     displaysettings.cpp \
     aboutsettings.cpp \
+    certificatecache.cpp \
     certificatemodel.cpp \
+    certificatetime.cpp \
     developermodesettings.cpp \
     batterystatus.cpp \
     diskusage.cpp \
     diskusage_impl.cpp \
+    diskusageindex.cpp \
+    diskusagemodel.cpp \
+    diskusagescheduler.cpp \
+    diskusagewalker.cpp \
     partition.cpp \
     partitionmanager.cpp \
     partitionmodel.cpp \
@@ -53,6 +59,7 @@ PUBLIC_HEADERS = \
     udisks2block_p.h \
     udisks2defines.h \
     diskusage.h \
+    diskusagemodel.h \
     partition.h \
     partitionmanager.h \
     partitionmodel.h \
@@ -66,8 +73,14 @@ HEADERS += \
     aboutsettings_p.h \
     localeconfig.h \
     batterystatus_p.h \
+    certificatecache_p.h \
+    certificatemodel_p.h \
+    certificatetime_p.h \
     logging_p.h \
     diskusage_p.h \
+    diskusageindex_p.h \
+    diskusagescheduler_p.h \
+    diskusagewalker_p.h \
     locationsettings_p.h \
     logging_p.h \
     partition_p.h \
@@ -7,3 +7,6 @@ src_plugins.depends = src
 OTHER_FILES += rpm/nemo-qml-plugin-systemsettings.spec
 
 SUBDIRS = src src_plugins setlocale tests
+
+# Not part of package builds, enable with "qmake CONFIG+=benchmarks"
+benchmarks: SUBDIRS += benchmarks
@@ -0,0 +1,27 @@
+# Shared by the unit tests, included after TARGET is set
+
+PACKAGENAME = nemo-qml-plugin-systemsettings
+
+QT += testlib
+QT -= gui
+
+TEMPLATE = app
+
+target.path = /usr/lib/$${PACKAGENAME}-tests
+
+contains(cov, true) {
+    message("Coverage options enabled")
+    QMAKE_CXXFLAGS += --coverage
+    QMAKE_LFLAGS += --coverage
+}
+
+CONFIG += link_prl
+DEFINES += UNIT_TEST
+QMAKE_EXTRA_TARGETS = check
+
+check.depends = $$TARGET
+check.commands = LD_LIBRARY_PATH=../../lib ./$$TARGET
+
+INCLUDEPATH += ../src/
+
+INSTALLS += target
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+
+#include "certificatemodel.h"
+
+#include "ut_certificatemodel.h"
+
+#include <QtTest>
+#include <QFile>
+#include <QStandardPaths>
+
+namespace {
+
+// Self-signed, sorted by their primary names
+const QStringList AllNames = QStringList() << "Alpha Root CA" << "Alphabet Services"
+        << "Beta Intermediate" << "Gamma Signing";
+
+QByteArray certificate(const QString &file)
+{
+    QFile pem(QStringLiteral(":/certificates/%1.pem").arg(file));
+    return pem.open(QIODevice::ReadOnly) ? pem.readAll() : QByteArray();
+}
+
+bool writeBundle(const QString &path, const QStringList &files)
+{
+    QByteArray data;
+    foreach (const QString &file, files)
+        data.append(certificate(file));
+
+    QFile bundle(path);
+    return bundle.open(QIODevice::WriteOnly | QIODevice::Truncate) && bundle.write(data) == data.size();
+}
+
+QStringList names(const CertificateModel &model)
+{
+    QStringList rv;
+    for (int row = 0; row < model.rowCount(); ++row)
+        rv.append(model.data(model.index(row), CertificateModel::PrimaryNameRole).toString());
+    return rv;
+}
+
+// The row ranges of a spy on rowsInserted or rowsRemoved, as "first-last"
+QStringList ranges(const QSignalSpy &spy)
+{
+    QStringList rv;
+    foreach (const QList<QVariant> &arguments, spy)
+        rv.append(QStringLiteral("%1-%2").arg(arguments.at(1).toInt()).arg(arguments.at(2).toInt()));
+    return rv;
+}
+
+}
+
+void Ut_CertificateModel::initTestCase()
+{
+    // Keeps the bundle caches out of the real cache directory
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void Ut_CertificateModel::init()
+{
+    m_dir = new QTemporaryDir;
+    QVERIFY(m_dir->isValid());
+    m_bundlePath = m_dir->path() + QStringLiteral("/bundle.pem");
+    m_bundleFiles = QStringList() << "gamma" << "alpha" << "beta" << "alphabet";
+    QVERIFY(writeBundle(m_bundlePath, m_bundleFiles));
+
+    m_model = new CertificateModel;
+    m_model->setBundlePath(m_bundlePath);
+    QTRY_COMPARE(m_model->rowCount(), AllNames.count());
+}
+
+void Ut_CertificateModel::cleanup()
+{
+    delete m_model;
+    m_model = 0;
+    delete m_dir;
+    m_dir = 0;
+}
+
+void Ut_CertificateModel::testFilter_data()
+{
+    QTest::addColumn<QString>("filter");
+    QTest::addColumn<QStringList>("expected");
+
+    QTest::newRow("empty") << QString() << AllNames;
+    QTest::newRow("prefix") << "al" << (QStringList() << "Alpha Root CA" << "Alphabet Services");
+    QTest::newRow("longer prefix") << "alphab" << (QStringList() << "Alphabet Services");
+    QTest::newRow("organization") << "trust" << (QStringList() << "Alpha Root CA" << "Beta Intermediate");
+    QTest::newRow("two terms") << "alpha ro" << (QStringList() << "Alpha Root CA");
+    QTest::newRow("two terms, any case") << "EXAMPLE beta" << (QStringList() << "Beta Intermediate");
+    QTest::newRow("no match") << "zzz" << QStringList();
+    QTest::newRow("fingerprint")
+            << "89:39:D7:6F:70:2F:B3:00:AC:85:F2:77:0C:D8:65:95:BF:07:90:5E:F9:14:B3:DE:35:42:54:D9:1A:65:86:CE"
+            << (QStringList() << "Gamma Signing");
+    QTest::newRow("fingerprint prefix") << "95:69:46" << (QStringList() << "Beta Intermediate");
+    QTest::newRow("fingerprint with spaces") << "14 62 32 46" << (QStringList() << "Alphabet Services");
+    QTest::newRow("fingerprint hex") << "75ae9f0e" << (QStringList() << "Alpha Root CA");
+}
+
+void Ut_CertificateModel::testFilter()
+{
+    QFETCH(QString, filter);
+    QFETCH(QStringList, expected);
+
+    m_model->setFilter(filter);
+    QCOMPARE(names(*m_model), expected);
+
+    m_model->setFilter(QString());
+    QCOMPARE(names(*m_model), AllNames);
+}
+
+void Ut_CertificateModel::testFilterNarrowing_data()
+{
+    QTest::addColumn<QString>("from");
+    QTest::addColumn<QString>("to");
+    QTest::addColumn<bool>("reset");
+    QTest::addColumn<int>("removals");
+    QTest::addColumn<QStringList>("expected");
+
+    // Typing on only removes the rows that no longer match
+    QTest::newRow("prefix typed on") << "al" << "alpha r" << false << 1
+            << (QStringList() << "Alpha Root CA");
+    QTest::newRow("term added") << "trust" << "trust beta" << false << 1
+            << (QStringList() << "Beta Intermediate");
+    QTest::newRow("fingerprint typed on") << "95:69" << "95:69:46" << false << 0
+            << (QStringList() << "Beta Intermediate");
+    QTest::newRow("separators only") << "alpha root" << "alpha, root" << false << 0
+            << (QStringList() << "Alpha Root CA");
+
+    // Anything else filters all the certificates again
+    QTest::newRow("prefix deleted") << "alpha r" << "al" << true << 0
+            << (QStringList() << "Alpha Root CA" << "Alphabet Services");
+    QTest::newRow("term changed") << "alpha" << "beta" << true << 0
+            << (QStringList() << "Beta Intermediate");
+    QTest::newRow("term removed") << "trust beta" << "trust" << true << 0
+            << (QStringList() << "Alpha Root CA" << "Beta Intermediate");
+}
+
+void Ut_CertificateModel::testFilterNarrowing()
+{
+    QFETCH(QString, from);
+    QFETCH(QString, to);
+    QFETCH(bool, reset);
+    QFETCH(int, removals);
+    QFETCH(QStringList, expected);
+
+    m_model->setFilter(from);
+
+    QSignalSpy resetSpy(m_model, SIGNAL(modelReset()));
+    QSignalSpy removedSpy(m_model, SIGNAL(rowsRemoved(QModelIndex,int,int)));
+    m_model->setFilter(to);
+
+    QCOMPARE(resetSpy.count(), reset ? 1 : 0);
+    QCOMPARE(removedSpy.count(), removals);
+    QCOMPARE(names(*m_model), expected);
+}
+
+void Ut_CertificateModel::testBundleRewritten_data()
+{
+    QTest::addColumn<QString>("filter");
+    QTest::addColumn<QStringList>("before");
+    QTest::addColumn<QStringList>("after");
+    QTest::addColumn<QStringList>("removed");
+    QTest::addColumn<QStringList>("inserted");
+    QTest::addColumn<QStringList>("expected");
+
+    const QStringList all = QStringList() << "gamma" << "alpha" << "beta" << "alphabet";
+    const QStringList two = QStringList() << "gamma" << "alpha";
+    const QStringList duplicate = QStringList() << "gamma" << "alpha" << "alpha" << "beta" << "alphabet";
+
+    QTest::newRow("removed") << QString() << all << two
+            << (QStringList() << "1-2") << QStringList()
+            << (QStringList() << "Alpha Root CA" << "Gamma Signing");
+    QTest::newRow("inserted") << QString() << two << all
+            << QStringList() << (QStringList() << "1-2")
+            << AllNames;
+    QTest::newRow("duplicate added") << QString() << all << duplicate
+            << QStringList() << (QStringList() << "1-1")
+            << (QStringList() << "Alpha Root CA" << AllNames);
+    QTest::newRow("duplicate removed") << QString() << duplicate << all
+            << (QStringList() << "0-0") << QStringList()
+            << AllNames;
+
+    // Only the matching rows are removed or inserted, at their filtered rows
+    QTest::newRow("removed, filtered") << "trust" << all << two
+            << (QStringList() << "1-1") << QStringList()
+            << (QStringList() << "Alpha Root CA");
+    QTest::newRow("inserted, filtered") << "trust" << two << all
+            << QStringList() << (QStringList() << "1-1")
+            << (QStringList() << "Alpha Root CA" << "Beta Intermediate");
+    QTest::newRow("duplicate added, filtered") << "trust" << all << duplicate
+            << QStringList() << (QStringList() << "1-1")
+            << (QStringList() << "Alpha Root CA" << "Alpha Root CA" << "Beta Intermediate");
+    QTest::newRow("not matching") << "gamma" << all << two
+            << QStringList() << QStringList()
+            << (QStringList() << "Gamma Signing");
+}
+
+void Ut_CertificateModel::testBundleRewritten()
+{
+    QFETCH(QString, filter);
+    QFETCH(QStringList, before);
+    QFETCH(QStringList, after);
+    QFETCH(QStringList, removed);
+    QFETCH(QStringList, inserted);
+    QFETCH(QStringList, expected);
+
+    // m_model stays unfiltered, it has all of a reload once it has its count
+    if (before != m_bundleFiles) {
+        QVERIFY(writeBundle(m_bundlePath, before));
+        QTRY_COMPARE(m_model->rowCount(), before.count());
+    }
+
+    CertificateModel model;
+    model.setBundlePath(m_bundlePath);
+    model.setFilter(filter);
+
+    QSignalSpy resetSpy(&model, SIGNAL(modelReset()));
+    QSignalSpy removedSpy(&model, SIGNAL(rowsRemoved(QModelIndex,int,int)));
+    QSignalSpy insertedSpy(&model, SIGNAL(rowsInserted(QModelIndex,int,int)));
+
+    QVERIFY(writeBundle(m_bundlePath, after));
+    QTRY_COMPARE(m_model->rowCount(), after.count());
+
+    QCOMPARE(resetSpy.count(), 0);
+    QCOMPARE(ranges(removedSpy), removed);
+    QCOMPARE(ranges(insertedSpy), inserted);
+    QCOMPARE(names(model), expected);
+}
+
+QTEST_GUILESS_MAIN(Ut_CertificateModel)
@@ -0,0 +1,20 @@
+TARGET = ut_certificatemodel
+
+include(tests.pri)
+
+CONFIG += link_pkgconfig
+PKGCONFIG += libcrypto
+
+SOURCES += ut_certificatemodel.cpp
+HEADERS += ut_certificatemodel.h
+RESOURCES += ut_certificatemodel.qrc
+
+SOURCES += \
+    ../src/certificatecache.cpp \
+    ../src/certificatemodel.cpp \
+    ../src/certificatetime.cpp
+HEADERS += \
+    ../src/certificatecache_p.h \
+    ../src/certificatemodel.h \
+    ../src/certificatemodel_p.h \
+    ../src/certificatetime_p.h
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "certificatetime_p.h"
+
+#include "ut_certificatetime.h"
+
+#include <QtTest>
+
+namespace {
+
+QDateTime utc(int year, int month, int day, int hour, int minute, int second = 0, int ms = 0)
+{
+    return QDateTime(QDate(year, month, day), QTime(hour, minute, second, ms), Qt::UTC);
+}
+
+QDateTime decode(const QByteArray &data, bool generalized)
+{
+    return CertificateTime::decode(data.constData(), data.length(), generalized);
+}
+
+}
+
+void Ut_CertificateTime::testDecode_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("generalized");
+    QTest::addColumn<QDateTime>("expected");
+
+    QTest::newRow("utc") << QByteArray("200314152653Z") << false << utc(2020, 3, 14, 15, 26, 53);
+    QTest::newRow("utc year 49") << QByteArray("491231235959Z") << false << utc(2049, 12, 31, 23, 59, 59);
+    QTest::newRow("utc year 50") << QByteArray("500101000000Z") << false << utc(1950, 1, 1, 0, 0);
+    QTest::newRow("utc year 69") << QByteArray("690601120000Z") << false << utc(1969, 6, 1, 12, 0);
+    QTest::newRow("utc without seconds") << QByteArray("2003141526Z") << false << utc(2020, 3, 14, 15, 26);
+    QTest::newRow("utc without zone") << QByteArray("200314152653") << false << utc(2020, 3, 14, 15, 26, 53);
+    QTest::newRow("utc leap day") << QByteArray("240229000000Z") << false << utc(2024, 2, 29, 0, 0);
+    QTest::newRow("utc positive offset") << QByteArray("200314152653+0130") << false
+                                         << utc(2020, 3, 14, 13, 56, 53);
+    QTest::newRow("utc negative offset") << QByteArray("200314152653-0800") << false
+                                         << utc(2020, 3, 14, 23, 26, 53);
+
+    QTest::newRow("generalized") << QByteArray("20500101000000Z") << true << utc(2050, 1, 1, 0, 0);
+    QTest::newRow("generalized far") << QByteArray("99991231235959Z") << true << utc(9999, 12, 31, 23, 59, 59);
+    QTest::newRow("generalized old") << QByteArray("19491231235959Z") << true << utc(1949, 12, 31, 23, 59, 59);
+    QTest::newRow("generalized hour") << QByteArray("2020031415Z") << true << utc(2020, 3, 14, 15, 0);
+    QTest::newRow("generalized minutes") << QByteArray("202003141526Z") << true << utc(2020, 3, 14, 15, 26);
+    QTest::newRow("generalized fraction") << QByteArray("20200314152653.5Z") << true
+                                          << utc(2020, 3, 14, 15, 26, 53, 500);
+    QTest::newRow("generalized milliseconds") << QByteArray("20200314152653.123Z") << true
+                                              << utc(2020, 3, 14, 15, 26, 53, 123);
+    QTest::newRow("generalized fraction truncated") << QByteArray("20200314152653.98765Z") << true
+                                                    << utc(2020, 3, 14, 15, 26, 53, 987);
+    QTest::newRow("generalized fraction without zone") << QByteArray("20200314152653.25") << true
+                                                       << utc(2020, 3, 14, 15, 26, 53, 250);
+    QTest::newRow("generalized offset") << QByteArray("20200314152653.5+0200") << true
+                                        << utc(2020, 3, 14, 13, 26, 53, 500);
+}
+
+void Ut_CertificateTime::testDecode()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, generalized);
+    QFETCH(QDateTime, expected);
+
+    const QDateTime decoded = decode(data, generalized);
+    QVERIFY(decoded.isValid());
+    QCOMPARE(decoded.toUTC(), expected);
+}
+
+void Ut_CertificateTime::testInvalid_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("generalized");
+
+    QTest::newRow("empty") << QByteArray() << false;
+    QTest::newRow("empty generalized") << QByteArray() << true;
+    QTest::newRow("short year") << QByteArray("2") << false;
+    QTest::newRow("short date") << QByteArray("2003") << false;
+    QTest::newRow("short hour") << QByteArray("2003141") << false;
+    QTest::newRow("utc without minutes") << QByteArray("20031415Z") << false;
+    QTest::newRow("utc as generalized") << QByteArray("200314152653Z") << true;
+    QTest::newRow("generalized as utc") << QByteArray("20200314152653Z") << false;
+    QTest::newRow("letters") << QByteArray("2003x4152653Z") << false;
+    QTest::newRow("sign in digits") << QByteArray("20-314152653Z") << false;
+    QTest::newRow("trailing garbage") << QByteArray("200314152653Zx") << false;
+    QTest::newRow("utc fraction") << QByteArray("200314152653.5Z") << false;
+    QTest::newRow("fraction without digits") << QByteArray("20200314152653.Z") << true;
+    QTest::newRow("fraction at end") << QByteArray("20200314152653.") << true;
+    QTest::newRow("fraction without seconds") << QByteArray("202003141526.5Z") << true;
+    QTest::newRow("short offset") << QByteArray("200314152653+01") << false;
+    QTest::newRow("offset without digits") << QByteArray("200314152653+") << false;
+    QTest::newRow("offset with letters") << QByteArray("200314152653+01a0") << false;
+
+    QTest::newRow("month 0") << QByteArray("200014152653Z") << false;
+    QTest::newRow("month 13") << QByteArray("201314152653Z") << false;
+    QTest::newRow("day 0") << QByteArray("200300152653Z") << false;
+    QTest::newRow("day 32") << QByteArray("200332152653Z") << false;
+    QTest::newRow("february 30") << QByteArray("200230000000Z") << false;
+    QTest::newRow("no leap day") << QByteArray("230229000000Z") << false;
+    QTest::newRow("hour 24") << QByteArray("200314240000Z") << false;
+    QTest::newRow("minute 60") << QByteArray("200314156000Z") << false;
+    QTest::newRow("second 60") << QByteArray("200314155960Z") << false;
+    QTest::newRow("offset hours 24") << QByteArray("200314152653+2400") << false;
+    QTest::newRow("offset minutes 60") << QByteArray("200314152653-0060") << false;
+}
+
+void Ut_CertificateTime::testInvalid()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, generalized);
+
+    QVERIFY(!decode(data, generalized).isValid());
+}
+
+QTEST_APPLESS_MAIN(Ut_CertificateTime)
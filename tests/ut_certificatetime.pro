@@ -0,0 +1,9 @@
+TARGET = ut_certificatetime
+
+include(tests.pri)
+
+SOURCES += ut_certificatetime.cpp
+HEADERS += ut_certificatetime.h
+
+SOURCES += ../src/certificatetime.cpp
+HEADERS += ../src/certificatetime_p.h
@@ -42,6 +42,18 @@
 static QVariantMap g_mocked_file_size;
 static QVariantMap g_mocked_rpm_size;
 static QVariantMap g_mocked_apkd_size;
+static QVariantList g_mocked_largest_entries;
+static QVariantMap g_mocked_packages;
+
+// Called from the worker thread of the service
+static QMutex g_measured_mutex;
+static QHash<QString, int> g_measured_count;
+
+static int measuredCount(const QString &directory)
+{
+    QMutexLocker locker(&g_measured_mutex);
+    return g_measured_count.value(directory);
+}
 
 #define MB(x) ((x) * 1024 * 1024)
 
@@ -52,31 +64,70 @@ static QVariantMap g_mocked_apkd_size;
 
 
 /* Mocked implementations of size calculation functions */
-quint64 DiskUsageWorker::calculateSize(QString directory, QString *expandedPath, bool)
+QObject *DiskUsageService::createScheduler(QObject *)
 {
-    if (expandedPath) {
-        *expandedPath = directory;
+    return 0;
+}
+
+QList<quint64> DiskUsageWorker::calculateSizes(const QStringList &directories, DiskUsage::Accounting,
+                                               const ProgressFunction &, const CancelFunction &,
+                                               int largestEntryCount, QVariantList *largestEntries,
+                                               const QStringList &subdirectories,
+                                               QList<quint64> *subdirectorySizes)
+{
+    QList<quint64> sizes;
+    foreach (const QString &directory, directories) {
+        sizes.append(quint64(g_mocked_file_size.value(directory, qlonglong(0)).toLongLong()));
+    }
+
+    if (subdirectorySizes) {
+        foreach (const QString &subdirectory, subdirectories) {
+            subdirectorySizes->append(quint64(g_mocked_file_size.value(subdirectory, qlonglong(0)).toLongLong()));
+        }
+    }
+
+    {
+        QMutexLocker locker(&g_measured_mutex);
+        foreach (const QString &directory, directories) {
+            ++g_measured_count[directory];
+        }
     }
 
-    return quint64(g_mocked_file_size.value(directory, qlonglong(0)).toLongLong());
+    if (largestEntries) {
+        *largestEntries = g_mocked_largest_entries.mid(0, largestEntryCount);
+    }
+
+    return sizes;
 }
 
-quint64 DiskUsageWorker::calculateRpmSize(const QString &glob)
+QList<quint64> DiskUsageWorker::calculateRpmSizes(const QStringList &globs)
 {
-    return quint64(g_mocked_rpm_size.value(glob, qlonglong(0)).toLongLong());
+    QList<quint64> sizes;
+    foreach (const QString &glob, globs) {
+        sizes.append(quint64(g_mocked_rpm_size.value(glob, qlonglong(0)).toLongLong()));
+    }
+
+    return sizes;
 }
 
-quint64 DiskUsageWorker::calculateApkdSize(const QString &rest)
+QVariantMap DiskUsageWorker::installedPackages()
 {
-    return quint64(g_mocked_apkd_size.value(rest, qlonglong(0)).toLongLong());
+    return g_mocked_packages;
 }
 
+void DiskUsageWorker::queryApkdUsage(const ApkdUsageFunction &done)
+{
+    done(quint64(g_mocked_apkd_size.value(QString(), qlonglong(0)).toLongLong()));
+}
 
 void Ut_DiskUsage::cleanup()
 {
     g_mocked_file_size.clear();
     g_mocked_rpm_size.clear();
     g_mocked_apkd_size.clear();
+    g_mocked_largest_entries.clear();
+    g_mocked_packages.clear();
+    g_measured_count.clear();
 }
 
 void Ut_DiskUsage::testSimple()
@@ -103,6 +154,24 @@ void Ut_DiskUsage::testSubtractApkdFromRoot()
     UT_DISKUSAGE_EXPECT_SIZE(":apkd:", MB(20))
 }
 
+void Ut_DiskUsage::testSubtractApkdPackages()
+{
+    // apkd only tells the total, the data directories of single apps are walked
+    const QString dataDirectory = QString(QDir("/home/.android").exists() ? "/home/.android" : "") + "/data/data";
+    g_mocked_file_size["/"] = MB(100);
+    g_mocked_apkd_size[""] = MB(20);
+    g_mocked_file_size[dataDirectory + "/com.example.a"] = MB(5);
+    g_mocked_file_size[dataDirectory + "/com.example.b"] = MB(3);
+
+    QVariantMap usage = DiskUsageWorker().calculate(QStringList() << "/" << ":apkd:"
+                                                    << ":apkd:com.example.a" << ":apkd:com.example.b");
+
+    UT_DISKUSAGE_EXPECT_SIZE("/", MB(80))
+    UT_DISKUSAGE_EXPECT_SIZE(":apkd:", MB(20) - MB(5) - MB(3))
+    UT_DISKUSAGE_EXPECT_SIZE(":apkd:com.example.a", MB(5))
+    UT_DISKUSAGE_EXPECT_SIZE(":apkd:com.example.b", MB(3))
+}
+
 void Ut_DiskUsage::testSubtractRPMFromRoot()
 {
     g_mocked_file_size["/"] = MB(200);
@@ -168,5 +237,228 @@ void Ut_DiskUsage::testSubtractNestedSubdirectoryMulti()
     UT_DISKUSAGE_EXPECT_SIZE("/opt/baz/", MB(10))
 }
 
+void Ut_DiskUsage::testSubtractManySubdirectories()
+{
+    const QString dataPath = QDir::homePath() + "/.local/share/";
+    QStringList paths = QStringList() << "/" << QDir::homePath() << ":rpm:" << ":rpm:harbour-*";
+    g_mocked_file_size["/"] = MB(2000);
+    g_mocked_file_size[QDir::homePath()] = MB(1000);
+    g_mocked_rpm_size[""] = MB(300);
+    g_mocked_rpm_size["harbour-*"] = MB(100);
+
+    for (int i = 0; i < 200; ++i) {
+        const QString path = dataPath + QString("harbour-app%1/").arg(i);
+        g_mocked_file_size[path] = MB(2);
+        g_mocked_file_size[path + "cache/"] = MB(1);
+        paths << path << path + "cache/";
+    }
+
+    QVariantMap usage = DiskUsageWorker().calculate(paths);
+
+    UT_DISKUSAGE_EXPECT_SIZE("/", MB(2000) - MB(1000) - MB(300))
+    UT_DISKUSAGE_EXPECT_SIZE(QDir::homePath(), MB(1000) - 200 * MB(2))
+    UT_DISKUSAGE_EXPECT_SIZE(":rpm:", MB(300) - MB(100))
+    UT_DISKUSAGE_EXPECT_SIZE(":rpm:harbour-*", MB(100))
+    for (int i = 0; i < 200; ++i) {
+        const QString path = dataPath + QString("harbour-app%1/").arg(i);
+        UT_DISKUSAGE_EXPECT_SIZE(path, MB(2) - MB(1))
+        UT_DISKUSAGE_EXPECT_SIZE(path + "cache/", MB(1))
+    }
+}
+
+
+void Ut_DiskUsage::testLargestEntries()
+{
+    g_mocked_file_size["/"] = MB(1000);
+    g_mocked_file_size["/home/"] = MB(500);
+    for (int i = 0; i < 3; ++i) {
+        QVariantMap entry;
+        entry["path"] = QString("/home/file%1").arg(i);
+        entry["size"] = qulonglong(MB(100 - i));
+        entry["isDirectory"] = false;
+        g_mocked_largest_entries.append(entry);
+    }
+
+    QVariantMap usage = DiskUsageWorker().calculate(QStringList() << "/" << "/home/" << ":largest:2");
+
+    UT_DISKUSAGE_EXPECT_SIZE("/", MB(1000) - MB(500))
+    UT_DISKUSAGE_EXPECT_SIZE("/home/", MB(500))
+
+    QVERIFY(usage.contains(":largest:2"));
+    const QVariantList largest = usage[":largest:2"].toList();
+    QCOMPARE(largest.count(), 2);
+    QCOMPARE(largest.at(0).toMap().value("path").toString(), QString("/home/file0"));
+    QCOMPARE(largest.at(1).toMap().value("size").toLongLong(), qlonglong(MB(99)));
+}
+
+void Ut_DiskUsage::testAttributeApplications()
+{
+    const QString home = QDir::homePath();
+    g_mocked_packages["harbour-a"] = qulonglong(MB(10));
+    g_mocked_packages["harbour-b"] = qulonglong(MB(20));
+    g_mocked_packages["sailfish-x"] = qulonglong(MB(100));
+    g_mocked_file_size[home] = MB(500);
+    g_mocked_file_size[home + "/.local/share/harbour-a"] = MB(50);
+    g_mocked_file_size[home + "/.cache/harbour-a"] = MB(5);
+    g_mocked_file_size[home + "/.config/harbour-b"] = MB(1);
+    g_mocked_apkd_size[""] = MB(7);
+
+    QVariantMap usage = DiskUsageWorker().calculate(QStringList() << ":apps:harbour-*");
+
+    QVERIFY(usage.contains(":apps:harbour-*"));
+    const QVariantMap apps = usage[":apps:harbour-*"].toMap();
+    QCOMPARE(apps.count(), 4);
+    QCOMPARE(apps["harbour-a"].toMap().value("data").toLongLong(), qlonglong(MB(50)));
+    QCOMPARE(apps["harbour-a"].toMap().value("cache").toLongLong(), qlonglong(MB(5)));
+    QCOMPARE(apps["harbour-a"].toMap().value("total").toLongLong(), qlonglong(MB(65)));
+    QCOMPARE(apps["harbour-b"].toMap().value("config").toLongLong(), qlonglong(MB(1)));
+    QCOMPARE(apps["harbour-b"].toMap().value("total").toLongLong(), qlonglong(MB(21)));
+    QCOMPARE(apps[":android:"].toMap().value("data").toLongLong(), qlonglong(MB(7)));
+    QCOMPARE(apps[":other:"].toMap().value("home").toLongLong(), qlonglong(MB(500) - MB(56)));
+    QCOMPARE(apps[":other:"].toMap().value("installed").toLongLong(), qlonglong(MB(100)));
+
+    // The application directories come from the walk of home
+    QCOMPARE(measuredCount(home), 1);
+    QCOMPARE(measuredCount(home + "/.local/share/harbour-a"), 0);
+}
+
+void Ut_DiskUsage::testCancelPending()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+
+    DiskUsageWorker worker;
+    QSignalSpy finished(&worker, SIGNAL(finished(QVariantMap,QVariantMap,int)));
+
+    // Cancelled before the worker got to it
+    worker.cancel(2);
+    worker.submit(QStringList() << "/home/", false, DiskUsage::ApparentSize, 2);
+    QCOMPARE(finished.count(), 1);
+    QVERIFY(finished.at(0).at(0).toMap().isEmpty());
+    QVERIFY(worker.m_cancelledRequests.isEmpty());
+
+    worker.submit(QStringList() << "/home/", false, DiskUsage::ApparentSize, 3);
+    QCOMPARE(finished.count(), 2);
+    QCOMPARE(finished.at(1).at(0).toMap().value("/home/").toLongLong(), qlonglong(MB(500)));
+}
+
+void Ut_DiskUsage::testCancelFinished()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+
+    DiskUsageWorker worker;
+    QSignalSpy finished(&worker, SIGNAL(finished(QVariantMap,QVariantMap,int)));
+
+    worker.submit(QStringList() << "/home/", false, DiskUsage::ApparentSize, 1);
+    worker.submit(QStringList() << "/home/", false, DiskUsage::ApparentSize, 2);
+
+    // The service may cancel a request whose result is still on its way
+    worker.cancel(1);
+    worker.cancel(2);
+    QVERIFY(worker.m_cancelledRequests.isEmpty());
+    QVERIFY(worker.m_activeRequests.isEmpty());
+
+    // Cancelled requests that never arrive are forgotten once a newer one does
+    worker.cancel(4);
+    worker.cancel(5);
+    worker.submit(QStringList() << "/home/", false, DiskUsage::ApparentSize, 6);
+    QVERIFY(worker.m_cancelledRequests.isEmpty());
+
+    QCOMPARE(finished.count(), 3);
+    QCOMPARE(finished.at(2).at(0).toMap().value("/home/").toLongLong(), qlonglong(MB(500)));
+}
+
+void Ut_DiskUsage::testServiceCoalescing()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+    g_mocked_file_size["/data/"] = MB(200);
+
+    DiskUsageService service;
+    QSignalSpy finished(&service, SIGNAL(finished(int,QVariantMap)));
+
+    // The second request joins the batch already measuring /home/
+    const int first = service.request(QStringList() << "/home/", false);
+    const int second = service.request(QStringList() << "/home/" << "/data/", false);
+    QTRY_COMPARE(finished.count(), 2);
+
+    QCOMPARE(measuredCount("/home/"), 1);
+    QCOMPARE(measuredCount("/data/"), 1);
+    foreach (const QList<QVariant> &arguments, finished) {
+        const QVariantMap usage = arguments.at(1).toMap();
+        QCOMPARE(usage.value("/home/").toLongLong(), qlonglong(MB(500)));
+        if (arguments.at(0).toInt() == second) {
+            QCOMPARE(usage.value("/data/").toLongLong(), qlonglong(MB(200)));
+        } else {
+            QCOMPARE(arguments.at(0).toInt(), first);
+            QVERIFY(!usage.contains("/data/"));
+        }
+    }
+}
+
+void Ut_DiskUsage::testServiceCancelShared()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+
+    DiskUsageService service;
+    QSignalSpy finished(&service, SIGNAL(finished(int,QVariantMap)));
+
+    // The batch goes on for the request still waiting for it
+    const int first = service.request(QStringList() << "/home/", false);
+    const int second = service.request(QStringList() << "/home/", false);
+    service.cancel(first);
+    QTRY_COMPARE(finished.count(), 1);
+
+    QCOMPARE(finished.at(0).at(0).toInt(), second);
+    QCOMPARE(finished.at(0).at(1).toMap().value("/home/").toLongLong(), qlonglong(MB(500)));
+    QCOMPARE(measuredCount("/home/"), 1);
+}
+
+void Ut_DiskUsage::testServiceCache()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+
+    DiskUsageService service;
+    QSignalSpy finished(&service, SIGNAL(finished(int,QVariantMap)));
+
+    service.request(QStringList() << "/home/", false);
+    QTRY_COMPARE(finished.count(), 1);
+    QCOMPARE(measuredCount("/home/"), 1);
+
+    // Answered from the cache, still asynchronously
+    g_mocked_file_size["/home/"] = MB(600);
+    const int cached = service.request(QStringList() << "/home/", false);
+    QCOMPARE(finished.count(), 1);
+    QTRY_COMPARE(finished.count(), 2);
+    QCOMPARE(finished.at(1).at(0).toInt(), cached);
+    QCOMPARE(finished.at(1).at(1).toMap().value("/home/").toLongLong(), qlonglong(MB(500)));
+    QCOMPARE(measuredCount("/home/"), 1);
+
+    // Measured again once the cached size is older than 30 seconds
+    for (QHash<DiskUsageService::PathKey, DiskUsageService::Measurement>::iterator it = service.m_cache.begin();
+            it != service.m_cache.end(); ++it) {
+        it->time -= 31 * 1000;
+    }
+    service.request(QStringList() << "/home/", false);
+    QTRY_COMPARE(finished.count(), 3);
+    QCOMPARE(finished.at(2).at(1).toMap().value("/home/").toLongLong(), qlonglong(MB(600)));
+    QCOMPARE(measuredCount("/home/"), 2);
+}
+
+void Ut_DiskUsage::testServiceAccounting()
+{
+    g_mocked_file_size["/home/"] = MB(500);
+
+    DiskUsageService service;
+    QSignalSpy finished(&service, SIGNAL(finished(int,QVariantMap)));
+
+    // Sizes counted one way neither join nor answer requests counting the other
+    service.request(QStringList() << "/home/", false, DiskUsage::ApparentSize);
+    service.request(QStringList() << "/home/", false, DiskUsage::AllocatedSize);
+    QTRY_COMPARE(finished.count(), 2);
+    QCOMPARE(measuredCount("/home/"), 2);
+
+    service.request(QStringList() << "/home/", false, DiskUsage::AllocatedSize);
+    QTRY_COMPARE(finished.count(), 3);
+    QCOMPARE(measuredCount("/home/"), 2);
+}
 
-QTEST_APPLESS_MAIN(Ut_DiskUsage)
+QTEST_GUILESS_MAIN(Ut_DiskUsage)
@@ -43,10 +43,21 @@ private slots:
 
     void testSimple();
     void testSubtractApkdFromRoot();
+    void testSubtractApkdPackages();
     void testSubtractRPMFromRoot();
     void testSubtractSubdirectory();
     void testSubtractNestedSubdirectory();
     void testSubtractNestedSubdirectoryMulti();
+    void testSubtractManySubdirectories();
+    void testLargestEntries();
+    void testAttributeApplications();
+    void testCancelPending();
+    void testCancelFinished();
+
+    void testServiceCoalescing();
+    void testServiceCancelShared();
+    void testServiceCache();
+    void testServiceAccounting();
 };
 
 #endif /* UT_DISKUSAGE_H */
@@ -0,0 +1,12 @@
+TARGET = ut_diskusage
+
+include(tests.pri)
+
+QT += qml dbus systeminfo
+
+SOURCES += ut_diskusage.cpp
+HEADERS += ut_diskusage.h
+
+SOURCES += ../src/diskusage.cpp
+HEADERS += ../src/diskusage.h
+HEADERS += ../src/diskusage_p.h
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2020 Open Mobile Platform LLC.
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+#include "diskusageindex_p.h"
+#include "diskusagewalker_p.h"
+
+#include "ut_diskusagewalker.h"
+
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QProcess>
+#include <QStandardPaths>
+
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Q_DECLARE_METATYPE(DiskUsageWalker::Accounting)
+
+namespace {
+
+void writeFile(const QString &path, int size)
+{
+    QFile file(path);
+    QVERIFY2(file.open(QIODevice::WriteOnly), qPrintable(file.errorString()));
+    QCOMPARE(file.write(QByteArray(size, 'x')), qint64(size));
+}
+
+void makeLink(const QString &target, const QString &path, bool hard)
+{
+    const QByteArray encodedTarget(QFile::encodeName(target));
+    const QByteArray encodedPath(QFile::encodeName(path));
+    const int result = hard ? ::link(encodedTarget.constData(), encodedPath.constData())
+                            : ::symlink(encodedTarget.constData(), encodedPath.constData());
+    QVERIFY2(result == 0, qPrintable(path));
+}
+
+// Holes of 8 MB on both sides of the data
+void writeSparseFile(const QString &path)
+{
+    const int fd = ::open(QFile::encodeName(path).constData(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    QVERIFY(fd >= 0);
+    const QByteArray data(4096, 'x');
+    QCOMPARE(::pwrite(fd, data.constData(), data.size(), 8 * 1024 * 1024), ssize_t(data.size()));
+    QCOMPARE(::ftruncate(fd, 16 * 1024 * 1024), 0);
+    ::close(fd);
+}
+
+// The total of du(1) with the given options for the path
+quint64 du(const QStringList &arguments, const QString &path)
+{
+    QProcess process;
+    process.start(QStringLiteral("du"), QStringList(arguments) << path, QIODevice::ReadOnly);
+    if (!process.waitForFinished() || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        return 0;
+    }
+    return QString::fromUtf8(process.readAll()).split('\t').value(0).toULongLong();
+}
+
+quint64 walk(DiskUsageWalker::Accounting accounting, int threads, const QString &path)
+{
+    DiskUsageWalker walker(threads);
+    walker.setAccounting(accounting);
+    return walker.walk(QStringList(path)).value(0);
+}
+
+quint64 walk(DiskUsageIndex *index, const QString &path)
+{
+    index->sync();
+
+    DiskUsageWalker walker(2);
+    walker.setAccounting(DiskUsageWalker::ApparentSize);
+    walker.setIndex(index);
+    return walker.walk(QStringList(path)).value(0);
+}
+
+quint64 du(const QString &path)
+{
+    return du(QStringList() << "-sbx", path);
+}
+
+// Seven directories, four levels deep, with a few files in each. The mtimes
+// are an hour old, so that records of the directories are not racy.
+const int IndexTreeDirectoryCount = 7;
+
+void createIndexTree(const QString &path)
+{
+    const QStringList directories = QStringList() << path << path + "/a" << path + "/a/b"
+            << path + "/a/b/c" << path + "/a/b/c/d" << path + "/e" << path + "/e/f";
+    QCOMPARE(directories.count(), IndexTreeDirectoryCount);
+
+    foreach (const QString &directory, directories) {
+        QVERIFY(QDir().mkpath(directory));
+        for (int i = 0; i < 3; ++i) {
+            writeFile(QString("%1/file%2").arg(directory).arg(i), 1000 * (i + 1));
+        }
+    }
+
+    const struct timespec times[2] = { { time(0) - 3600, 0 }, { time(0) - 3600, 0 } };
+    foreach (const QString &directory, directories) {
+        QCOMPARE(::utimensat(AT_FDCWD, QFile::encodeName(directory).constData(), times, 0), 0);
+    }
+}
+
+}
+
+void Ut_DiskUsageWalker::initTestCase()
+{
+    if (QStandardPaths::findExecutable(QStringLiteral("du")).isEmpty()) {
+        QSKIP("du is needed for reference sizes");
+    }
+
+    QVERIFY(m_root.isValid());
+    m_tree = m_root.path() + QStringLiteral("/tree");
+
+    QDir dir;
+    QVERIFY(dir.mkpath(m_tree + "/a"));
+    QVERIFY(dir.mkpath(m_tree + "/b/c/d"));
+    QVERIFY(dir.mkpath(m_tree + "/empty/nested"));
+
+    writeFile(m_tree + "/file", 10000);
+    writeFile(m_tree + "/small", 1);
+    writeFile(m_tree + "/zero", 0);
+    writeFile(m_tree + "/b/c/d/deep", 70000);
+    for (int i = 0; i < 50; ++i) {
+        writeFile(QString("%1/a/file%2").arg(m_tree).arg(i), i * 100);
+    }
+
+    // Three links to one file, in different directories
+    writeFile(m_tree + "/linked", 20000);
+    makeLink(m_tree + "/linked", m_tree + "/a/hardlink", true);
+    makeLink(m_tree + "/linked", m_tree + "/b/c/hardlink", true);
+
+    makeLink(QStringLiteral("file"), m_tree + "/symlink", false);
+    makeLink(QStringLiteral("does/not/exist/anywhere"), m_tree + "/a/dangling", false);
+    makeLink(QStringLiteral("../a"), m_tree + "/b/directorylink", false);
+
+    writeSparseFile(m_tree + "/sparse");
+}
+
+void Ut_DiskUsageWalker::testMatchesDu_data()
+{
+    QTest::addColumn<DiskUsageWalker::Accounting>("accounting");
+    QTest::addColumn<QStringList>("arguments");
+    QTest::addColumn<int>("threads");
+
+    const QStringList apparent = QStringList() << "-sbx";
+    const QStringList allocated = QStringList() << "-sx" << "-B1";
+
+    QTest::newRow("apparent, one thread") << DiskUsageWalker::ApparentSize << apparent << 1;
+    QTest::newRow("apparent, four threads") << DiskUsageWalker::ApparentSize << apparent << 4;
+    QTest::newRow("allocated, one thread") << DiskUsageWalker::AllocatedSize << allocated << 1;
+    QTest::newRow("allocated, four threads") << DiskUsageWalker::AllocatedSize << allocated << 4;
+}
+
+void Ut_DiskUsageWalker::testMatchesDu()
+{
+    QFETCH(DiskUsageWalker::Accounting, accounting);
+    QFETCH(QStringList, arguments);
+    QFETCH(int, threads);
+
+    const quint64 expected = du(arguments, m_tree);
+    QVERIFY(expected > 0);
+    QCOMPARE(walk(accounting, threads, m_tree), expected);
+}
+
+void Ut_DiskUsageWalker::testSeveralPaths()
+{
+    // Walked together, yet each path counts the hard linked file on its own
+    const QStringList paths = QStringList() << m_tree << m_tree + "/a" << m_tree + "/b" << m_tree + "/empty";
+
+    DiskUsageWalker walker(4);
+    walker.setAccounting(DiskUsageWalker::ApparentSize);
+    const QList<quint64> sizes = walker.walk(paths);
+
+    QCOMPARE(sizes.count(), paths.count());
+    for (int i = 0; i < paths.count(); ++i) {
+        QCOMPARE(sizes.at(i), du(QStringList() << "-sbx", paths.at(i)));
+    }
+}
+
+void Ut_DiskUsageWalker::testIndexUnchanged()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    const quint64 expected = du(tree);
+    QCOMPARE(walk(&index, tree), expected);
+    QCOMPARE(index.watchCount(), IndexTreeDirectoryCount);
+
+    // From the index, all directories stay watched
+    QCOMPARE(walk(&index, tree), expected);
+    QCOMPARE(index.watchCount(), IndexTreeDirectoryCount);
+}
+
+void Ut_DiskUsageWalker::testIndexChangedDeep()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    QCOMPARE(walk(&index, tree), du(tree));
+
+    // A new file, and one that grows in place without changing the mtime
+    // of its directory
+    writeFile(tree + "/a/b/c/d/new", 12345);
+    QFile file(tree + "/e/f/file0");
+    QVERIFY(file.open(QIODevice::Append));
+    QCOMPARE(file.write(QByteArray(5000, 'y')), qint64(5000));
+    file.close();
+
+    QCOMPARE(walk(&index, tree), du(tree));
+    QCOMPARE(walk(&index, tree + "/a"), du(tree + "/a"));
+}
+
+void Ut_DiskUsageWalker::testIndexReloaded()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    const QString indexPath = root.path() + "/index";
+    createIndexTree(tree);
+
+    {
+        DiskUsageIndex index(indexPath);
+        QCOMPARE(walk(&index, tree), du(tree));
+        index.save();
+    }
+    QVERIFY(QFile::exists(indexPath));
+
+    // Changed while nothing watched, as between two processes
+    writeFile(tree + "/a/b/c/d/new", 54321);
+    QVERIFY(QFile::remove(tree + "/e/f/file2"));
+
+    DiskUsageIndex index(indexPath);
+    QCOMPARE(walk(&index, tree), du(tree));
+    QCOMPARE(walk(&index, tree + "/e"), du(tree + "/e"));
+}
+
+void Ut_DiskUsageWalker::testIndexWatchLimit()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    index.setWatchLimit(3);
+    QCOMPARE(walk(&index, tree), du(tree));
+    QVERIFY(index.watchCount() <= 3);
+
+    // Directories that could not be watched are not trusted, also when
+    // their mtime stays the same
+    foreach (const QString &path, QStringList() << tree + "/file0" << tree + "/a/b/c/d/file0") {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::Append));
+        QCOMPARE(file.write(QByteArray(3000, 'y')), qint64(3000));
+    }
+
+    QCOMPARE(walk(&index, tree), du(tree));
+    QVERIFY(index.watchCount() <= 3);
+}
+
+void Ut_DiskUsageWalker::testIndexRemovedDirectory()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    QCOMPARE(walk(&index, tree), du(tree));
+    QCOMPARE(index.watchCount(), IndexTreeDirectoryCount);
+
+    // The watches of the removed directories go with them
+    QVERIFY(QDir(tree + "/a/b").removeRecursively());
+    QCOMPARE(walk(&index, tree), du(tree));
+    QCOMPARE(index.watchCount(), IndexTreeDirectoryCount - 3);
+}
+
+void Ut_DiskUsageWalker::testIndexHardLinks()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    makeLink(tree + "/a/b/file0", tree + "/e/link", true);
+
+    // Measured on its own, the subtree counts the file, but that size must
+    // not be reused when the link elsewhere is found first
+    DiskUsageIndex index(root.path() + "/index");
+    QCOMPARE(walk(&index, tree + "/a"), du(tree + "/a"));
+    QCOMPARE(walk(&index, tree), du(tree));
+    writeFile(tree + "/e/new", 100);
+    QCOMPARE(walk(&index, tree), du(tree));
+    QCOMPARE(walk(&index, tree), du(tree));
+}
+
+void Ut_DiskUsageWalker::testIndexReportedDirectories()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    const QStringList reported = QStringList() << tree + "/a/b/c" << tree + "/e/" << tree + "/missing";
+
+    // Walked the first time, and below a tree found in the index the second
+    for (int i = 0; i < 2; ++i) {
+        index.sync();
+
+        DiskUsageWalker walker(2);
+        walker.setAccounting(DiskUsageWalker::ApparentSize);
+        walker.setIndex(&index);
+        walker.setReportedDirectories(reported);
+        QCOMPARE(walker.walk(QStringList(tree)).value(0), du(tree));
+
+        const QHash<QString, quint64> sizes = walker.reportedSizes();
+        QCOMPARE(sizes.count(), 2);
+        QCOMPARE(sizes.value(tree + "/a/b/c"), du(tree + "/a/b/c"));
+        QCOMPARE(sizes.value(tree + "/e"), du(tree + "/e"));
+    }
+}
+
+void Ut_DiskUsageWalker::testCancel()
+{
+    DiskUsageWalker walker(2);
+    walker.setAccounting(DiskUsageWalker::ApparentSize);
+    walker.setCancelFunction([]() { return true; });
+    QVERIFY(walker.walk(QStringList(m_tree)).value(0) < du(m_tree));
+}
+
+void Ut_DiskUsageWalker::testCancelIndex()
+{
+    QTemporaryDir root;
+    const QString tree = root.path() + "/tree";
+    createIndexTree(tree);
+
+    DiskUsageIndex index(root.path() + "/index");
+    const quint64 expected = du(tree);
+
+    // Stopped halfway, the partial sizes must not end up in the index
+    std::atomic<int> polls(0);
+    DiskUsageWalker walker(2);
+    walker.setAccounting(DiskUsageWalker::ApparentSize);
+    walker.setIndex(&index);
+    walker.setCancelFunction([&polls]() { return ++polls > 10; });
+    index.sync();
+    QVERIFY(walker.walk(QStringList(tree)).value(0) < expected);
+
+    QCOMPARE(walk(&index, tree), expected);
+    QCOMPARE(walk(&index, tree), expected);
+}
+
+QTEST_GUILESS_MAIN(Ut_DiskUsageWalker)
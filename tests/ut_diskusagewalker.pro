@@ -0,0 +1,13 @@
+TARGET = ut_diskusagewalker
+
+include(tests.pri)
+
+SOURCES += ut_diskusagewalker.cpp
+HEADERS += ut_diskusagewalker.h
+
+SOURCES += \
+    ../src/diskusageindex.cpp \
+    ../src/diskusagewalker.cpp
+HEADERS += \
+    ../src/diskusageindex_p.h \
+    ../src/diskusagewalker_p.h